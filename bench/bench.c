@@ -0,0 +1,232 @@
+// Timings of the drawing paths behind the engine's performance choices. Each
+// prints the best of many runs, so run the release build.
+#include "../src/twig.c"
+
+typedef void (*BenchFn)(int arg);
+
+// Runs [fn] once to warm the caches, then returns its best time over [runs]
+// runs in microseconds.
+double bench_best(BenchFn fn, int arg, int runs) {
+  LARGE_INTEGER freq, start, end;
+  QueryPerformanceFrequency(&freq);
+  fn(arg);
+  double best = 1e30;
+  for (int i = 0; i < runs; i++) {
+    QueryPerformanceCounter(&start);
+    fn(arg);
+    QueryPerformanceCounter(&end);
+    double us = (double)(end.QuadPart - start.QuadPart) * 1e6 / (double)freq.QuadPart;
+    best = us < best ? us : best;
+  }
+  return best;
+}
+
+Bitmap* bench_dst;
+Bitmap* bench_src;
+
+void bench_blit_ex_run(int kind) {
+  Color tint = {0xff, 0xff, 0xff, 0xff};
+  Transform tf = {160, 120, kind == 2 ? 0.7f : 0, kind == 3 ? 1.5f : 1, kind == 3 ? 1.5f : 1, 64, 64};
+  for (int i = 0; i < 10; i++) {
+    if (kind == 0) {
+      bmp_blit_tint(bench_dst, bench_src, 96, 56, 0, 0, 128, 128, tint);
+    } else {
+      bmp_blit_ex(bench_dst, bench_src, 0, 0, 128, 128, &tf, tint);
+    }
+  }
+}
+
+// A 128x128 source with some translucent pixels onto a 320x240 target.
+void bench_blit_ex(void) {
+  bench_dst = bmp_create(320, 240);
+  bench_src = bmp_create(128, 128);
+  for (int i = 0; i < 128 * 128; i++) {
+    bench_src->data[i] = new_color(i, i >> 3, i >> 7, i % 5 ? 0xff : 100);
+  }
+  bmp_classify(bench_src);
+
+  const char* names[] = {"blitTint", "blitEx identity", "blitEx rotated 0.7", "blitEx scaled 1.5x"};
+  printf("transformed blits, 128x128 onto 320x240\n");
+  for (int kind = 0; kind < 4; kind++) {
+    printf("  %-24s %7.1f us\n", names[kind], bench_best(bench_blit_ex_run, kind, 300) / 10);
+  }
+
+  bmp_destroy(bench_dst);
+  bmp_destroy(bench_src);
+}
+
+Color bench_row_src[2048], bench_row_dst[2048];
+BlitRowFn bench_row_fn;
+
+void bench_row_scalar(Color* td, const Color* ts, int w, Color tint) {
+  blit_row_scalar(td, ts, w, tint, BLEND_ALPHA);
+}
+
+void bench_row_run(int w) {
+  Color tint = {0xff, 0xff, 0xff, 0xff};
+  for (int i = 0; i < 1024; i++) {
+    tint.a = (unsigned char)(60 + (i & 63));
+    bench_row_fn(&bench_row_dst[i], &bench_row_src[i & 511], w, tint);
+  }
+}
+
+// Opaque rows under a varying constant alpha: the C kernel looks the blend up
+// in blend_lut, the others multiply.
+void bench_blend_lut(void) {
+  for (int i = 0; i < 2048; i++) {
+    bench_row_src[i] = new_color(rand(), rand(), rand(), 0xff);
+    bench_row_dst[i] = new_color(rand(), rand(), rand(), rand());
+  }
+
+  const char* names[] = {"lut", "scalar", "sse2", "avx2"};
+  BlitRowFn fns[] = {blit_kernels_c[true][TINT_ALPHA][BLEND_ALPHA], bench_row_scalar,
+                     blit_kernels_sse2[true][TINT_ALPHA][BLEND_ALPHA],
+                     blit_kernels_avx2[true][TINT_ALPHA][BLEND_ALPHA]};
+  int kernels = __builtin_cpu_supports("avx2") ? 4 : 3;
+  int widths[] = {1, 2, 3, 4, 7, 8, 16, 64, 320, 1024};
+
+  printf("constant-alpha rows, ns per row\n  width");
+  for (int k = 0; k < kernels; k++) {
+    printf(" %8s", names[k]);
+  }
+  printf("\n");
+  for (int i = 0; i < 10; i++) {
+    printf("  %5d", widths[i]);
+    for (int k = 0; k < kernels; k++) {
+      bench_row_fn = fns[k];
+      printf(" %8.1f", bench_best(bench_row_run, widths[i], 50) * 1000 / 1024);
+    }
+    printf("\n");
+  }
+}
+
+Sprite* bench_tiles[40];
+Sprite* bench_tall;
+
+void bench_layout_run(int workload) {
+  int w = bench_dst->w, h = bench_dst->h;
+  Command cmd = {.dst = bench_dst, .cw = -1, .ch = -1, .blit_mode = BLEND_ALPHA};
+  srand(3);
+  switch (workload) {
+    case 0:
+      cmd.type = CMD_LINE;
+      for (int i = 0; i < 2000; i++) {
+        cmd.x = rand() % w;
+        cmd.y = rand() % h;
+        cmd.sx = rand() % w;
+        cmd.sy = rand() % h;
+        cmd.color = new_color(rand(), rand(), rand(), 0xff);
+        cmd_execute(&cmd, nullptr);
+      }
+      break;
+    case 1:
+      cmd.type = CMD_LINE;
+      for (int i = 0; i < 4000; i++) {
+        cmd.x = rand() % w;
+        cmd.y = rand() % (h / 2);
+        cmd.sx = cmd.x + rand() % 9 - 4;
+        cmd.sy = cmd.y + h / 2;
+        cmd.color = new_color(rand(), rand(), rand(), 200);
+        cmd_execute(&cmd, nullptr);
+      }
+      break;
+    case 2:
+      cmd.type = CMD_RECT_LINE;
+      for (int i = 0; i < 4000; i++) {
+        cmd.x = rand() % (w - 100);
+        cmd.y = rand() % (h - 200);
+        cmd.w = 10 + rand() % 90;
+        cmd.h = 20 + rand() % 180;
+        cmd.color = new_color(rand(), rand(), rand(), 0xff);
+        cmd_execute(&cmd, nullptr);
+      }
+      break;
+    case 3:
+      cmd.type = CMD_SPRITE;
+      cmd.color = new_color(0xff, 0xff, 0xff, 0xff);
+      cmd.w = cmd.h = 16;
+      for (int y = 0; y < h; y += 16) {
+        for (int x = 0; x < w; x += 16) {
+          cmd.spr = bench_tiles[(x / 16 + y / 16 * 3) % 40];
+          cmd.x = x;
+          cmd.y = y;
+          cmd_execute(&cmd, nullptr);
+        }
+      }
+      break;
+    case 4:
+      cmd.type = CMD_SPRITE;
+      cmd.color = new_color(0xff, 0xff, 0xff, 0xff);
+      cmd.spr = bench_tall;
+      cmd.w = bench_tall->w;
+      cmd.h = bench_tall->h;
+      for (int i = 0; i < 2000; i++) {
+        cmd.x = rand() % w;
+        cmd.y = rand() % h - 100;
+        cmd_execute(&cmd, nullptr);
+      }
+      break;
+    case 5:
+      bmp_clear(bench_dst, new_color(1, 2, 3, 0xff));
+      cmd.type = CMD_BLIT;
+      cmd.src = bench_src;
+      cmd.w = bench_src->w;
+      cmd.h = bench_src->h;
+      for (int i = 0; i < 200; i++) {
+        cmd.x = rand() % w - 100;
+        cmd.y = rand() % h - 100;
+        cmd_execute(&cmd, nullptr);
+      }
+      break;
+    case 6:
+      if (bench_dst->blocks) {
+        bmp_deswizzle(bench_dst, 0, 0, w, h);
+      }
+      break;
+  }
+}
+
+// The same workloads on a row-major and a tiled screen. Presenting a tiled
+// screen de-swizzles it, which row-major screens never pay.
+void bench_layouts(void) {
+  size_t size;
+  char* png = read_data("roguelike.png", &size);
+  bench_src = bmp_load(png, (int)size, false);
+  free(png);
+  for (int i = 0; i < 40; i++) {
+    bench_tiles[i] = sprite_compile(bench_src, 17 * (i % 20), 17 * (i / 20), 16, 16);
+  }
+  bench_tall = sprite_compile(bench_src, 0, 0, 24, 300);
+
+  const char* names[] = {"2000 random lines",   "4000 near-vertical lines", "4000 tall rect outlines",
+                         "16x16 sprite grid",   "2000 24x300 sprites",      "clear + 200 sheet blits",
+                         "present de-swizzle"};
+  int sizes[2][2] = {{320, 240}, {1920, 1080}};
+  for (int s = 0; s < 2; s++) {
+    printf("screen layouts at %dx%d, ms\n", sizes[s][0], sizes[s][1]);
+    for (int workload = 0; workload < 7; workload++) {
+      double ms[2];
+      for (int tiled = 0; tiled < 2; tiled++) {
+        bench_dst = bmp_create(sizes[s][0], sizes[s][1]);
+        bmp_use_blocks(bench_dst, tiled);
+        ms[tiled] = bench_best(bench_layout_run, workload, s ? 30 : 100) / 1000;
+        bmp_destroy(bench_dst);
+      }
+      printf("  %-26s rows %8.3f  tiled %8.3f\n", names[workload], ms[0], ms[1]);
+    }
+  }
+
+  for (int i = 0; i < 40; i++) {
+    sprite_destroy(bench_tiles[i]);
+  }
+  sprite_destroy(bench_tall);
+  bmp_destroy(bench_src);
+}
+
+int main(void) {
+  blit_init();
+  bench_blit_ex();
+  bench_blend_lut();
+  bench_layouts();
+  return 0;
+}
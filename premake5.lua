@@ -54,3 +54,29 @@ project "twig"
   prebuildcommands {
     "\"C:\\Program Files\\7-Zip\\7z.exe\" a -tzip -mx=9 data.zip ../data/* -bso0"
   }
+
+project "tests"
+  kind "consoleapp"
+  language "c"
+  cdialect "c23"
+  warnings "extra"
+  dependson { "twig" }
+
+  targetdir "%{wks.location}/bin/%{cfg.buildcfg}"
+  objdir "%{wks.location}/tests/obj/%{cfg.buildcfg}"
+
+  files { "tests/tests.c" }
+  links { "miniz", "wren", "stb_image", "winmm" }
+
+project "bench"
+  kind "consoleapp"
+  language "c"
+  cdialect "c23"
+  warnings "extra"
+  dependson { "twig" }
+
+  targetdir "%{wks.location}/bin/%{cfg.buildcfg}"
+  objdir "%{wks.location}/bench/obj/%{cfg.buildcfg}"
+
+  files { "bench/bench.c" }
+  links { "miniz", "wren", "stb_image", "winmm" }
@@ -1,7 +1,11 @@
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <immintrin.h>
 #include <windows.h>
 
 #include "lib/miniz.h"
@@ -14,6 +18,9 @@
 
 #define EXPAND(X) ((X) + ((X) > 0))
 
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
 #define CLIP0(CX, X, X2, W) \
   if (X < CX) {             \
     int D = CX - X;         \
@@ -91,21 +98,70 @@ char* read_data(const char* filename, size_t* size) {
 
 // BITMAP MANAGEMENT
 
+// Only BLEND_ALPHA moves the destination alpha.
 enum {
   KEEP_ALPHA = 0,
   BLEND_ALPHA = 1,
+  BLEND_ADD = 2,
+  BLEND_MULTIPLY = 3,
+  BLEND_SCREEN = 4,
+  BLEND_SUBTRACT = 5,
+};
+
+#define NUM_BLIT_MODES 6
+
+enum {
+  ALPHA_OPAQUE = 0,
+  ALPHA_BINARY = 1,
+  ALPHA_TRANSLUCENT = 2,
+};
+
+enum {
+  SPAN_SKIP = 0,
+  SPAN_OPAQUE = 1,
+  SPAN_BLEND = 2,
 };
 
+#define SPAN_SIZE 16
+#define ROW_ALIGN 64
+#define SPAN_KIND(A) ((A) == 0 ? SPAN_SKIP : (A) == 0xff ? SPAN_OPAQUE : SPAN_BLEND)
+
 typedef struct {
   unsigned char b, g, r, a;
 } Color;
 
+// Views share their root's pixels and span table; damage, coverage and blocks live on the root.
+#define MAX_DAMAGE 32
+#define DAMAGE_SLACK 256
+
+typedef struct {
+  int x0, y0, x1, y1;
+} DamageRect;
+
 typedef struct {
+  DamageRect rects[MAX_DAMAGE];
+  int num_rects;
+} Damage;
+
+typedef struct Bitmap Bitmap;
+
+struct Bitmap {
   int w, h;
+  int stride;
   int cx, cy, cw, ch;
   Color* data;
   int blit_mode;
-} Bitmap;
+  int alpha_class;
+  unsigned char* spans;
+  bool dirty;
+  bool premultiplied;
+  Bitmap* root;
+  int ox, oy;
+  int refs;
+  Damage* damage;
+  uint64_t* coverage;
+  Color* blocks;
+};
 
 Color new_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
   Color color;
@@ -116,248 +172,2648 @@ Color new_color(unsigned char r, unsigned char g, unsigned char b, unsigned char
   return color;
 }
 
-Bitmap* bmp_create(int w, int h) {
-  Bitmap* bmp = (Bitmap*)calloc(1, sizeof(Bitmap));
-  bmp->w = w;
-  bmp->h = h;
-  bmp->cw = -1;
-  bmp->ch = -1;
-  bmp->data = (Color*)calloc(w * h, sizeof(Color));
-  bmp->blit_mode = BLEND_ALPHA;
-  return bmp;
+// BLIT KERNELS
+
+// Blends [w] pixels of [ts] tinted by [tint] into [td], bit-exact with blit_row_scalar.
+typedef void (*BlitRowFn)(Color* td, const Color* ts, int w, Color tint);
+
+enum {
+  TINT_NONE = 0,
+  TINT_ALPHA = 1,
+  TINT_FULL = 2,
+};
+
+// Combines channel [d] with a contribution [p] already scaled by coverage [a] (0..256).
+ALWAYS_INLINE int blend_channel(int d, int p, int a, const int mode) {
+  int v;
+  switch (mode) {
+    case BLEND_ADD:
+      v = d + p;
+      break;
+    case BLEND_SUBTRACT:
+      v = d - p;
+      break;
+    case BLEND_SCREEN:
+      v = d + p - (p * EXPAND(d) >> 8);
+      break;
+    case BLEND_MULTIPLY:
+    default: {
+      int f = 256 - a + EXPAND(p);
+      v = d * (f < 256 ? f : 256) >> 8;
+      break;
+    }
+  }
+  return v < 0 ? 0 : (v > 255 ? 255 : v);
 }
 
-Bitmap* bmp_load(void* data, int len) {
-  Bitmap* bmp = (Bitmap*)calloc(1, sizeof(Bitmap));
-  bmp->cw = -1;
-  bmp->ch = -1;
-  bmp->blit_mode = BLEND_ALPHA;
+// The reference kernel tests/tests.c checks every specialization against.
+void blit_row_scalar(Color* td, const Color* ts, int w, Color tint, int mode) {
+  int xr = EXPAND(tint.r);
+  int xg = EXPAND(tint.g);
+  int xb = EXPAND(tint.b);
+  int xa = EXPAND(tint.a);
 
-  unsigned char* img_data = stbi_load_from_memory(data, len, &bmp->w, &bmp->h, nullptr, 4);
-  if (!img_data) {
-    free(bmp);
-    return nullptr;
+  for (int x = 0; x < w; x++) {
+    unsigned r = (xr * ts[x].r) >> 8;
+    unsigned g = (xg * ts[x].g) >> 8;
+    unsigned b = (xb * ts[x].b) >> 8;
+    if (mode > BLEND_ALPHA) {
+      int c = EXPAND(ts[x].a) * xa >> 8;
+      td[x].r = (unsigned char)blend_channel(td[x].r, r * c >> 8, c, mode);
+      td[x].g = (unsigned char)blend_channel(td[x].g, g * c >> 8, c, mode);
+      td[x].b = (unsigned char)blend_channel(td[x].b, b * c >> 8, c, mode);
+      continue;
+    }
+    unsigned a = xa * EXPAND(ts[x].a);
+    td[x].r += (unsigned char)((r - td[x].r) * a >> 16);
+    td[x].g += (unsigned char)((g - td[x].g) * a >> 16);
+    td[x].b += (unsigned char)((b - td[x].b) * a >> 16);
+    td[x].a += mode * (unsigned char)((ts[x].a - td[x].a) * a >> 16);
   }
+}
 
-  bmp->data = (Color*)calloc(bmp->w * bmp->h, sizeof(Color));
-  if (!bmp->data) {
-    stbi_image_free(img_data);
-    free(bmp);
-    return nullptr;
+// Opaque sources with no tint blend with a full factor, which is a copy.
+ALWAYS_INLINE void blit_copy_c(Color* td, const Color* ts, int w, const int mode) {
+  if (mode == BLEND_ALPHA) {
+    memcpy(td, ts, w * sizeof(Color));
+    return;
+  }
+  for (int x = 0; x < w; x++) {
+    td[x].r = ts[x].r;
+    td[x].g = ts[x].g;
+    td[x].b = ts[x].b;
   }
+}
 
-  for (int y = 0; y < bmp->h; y++) {
-    for (int x = 0; x < bmp->w; x++) {
-      int src_i = (y * bmp->w + x) * 4;
-      int dst_i = y * bmp->w + x;
-      bmp->data[dst_i] = new_color(img_data[src_i], img_data[src_i + 1], img_data[src_i + 2], img_data[src_i + 3]);
+// The color modes, for straight and premultiplied sources.
+ALWAYS_INLINE void blit_mode_c(Color* td, const Color* ts, int w, Color tint, const int mode, const int kind,
+                               const bool opaque, const bool premultiplied) {
+  int xa = kind == TINT_NONE ? 256 : EXPAND(tint.a);
+  int xr = kind == TINT_FULL ? EXPAND(tint.r) : 256;
+  int xg = kind == TINT_FULL ? EXPAND(tint.g) : 256;
+  int xb = kind == TINT_FULL ? EXPAND(tint.b) : 256;
+
+  for (int x = 0; x < w; x++) {
+    int r, g, b, a;
+    if (premultiplied) {
+      a = EXPAND((opaque ? 255 : ts[x].a) * xa >> 8);
+      r = ts[x].r * (xr * xa >> 8) >> 8;
+      g = ts[x].g * (xg * xa >> 8) >> 8;
+      b = ts[x].b * (xb * xa >> 8) >> 8;
+    } else {
+      a = (opaque ? 256 : EXPAND(ts[x].a)) * xa >> 8;
+      r = (xr * ts[x].r >> 8) * a >> 8;
+      g = (xg * ts[x].g >> 8) * a >> 8;
+      b = (xb * ts[x].b >> 8) * a >> 8;
     }
+    td[x].r = (unsigned char)blend_channel(td[x].r, r, a, mode);
+    td[x].g = (unsigned char)blend_channel(td[x].g, g, a, mode);
+    td[x].b = (unsigned char)blend_channel(td[x].b, b, a, mode);
   }
+}
 
-  stbi_image_free(img_data);
-  return bmp;
+// blend_lut[a][255 + c - d] holds (c - d) * EXPAND(a) >> 8 for opaque sources under alpha a.
+unsigned char blend_lut[256][511];
+
+ALWAYS_INLINE void blit_lut_c(Color* td, const Color* ts, int w, Color tint, const int mode) {
+  const unsigned char* lut = &blend_lut[tint.a][255];
+  for (int x = 0; x < w; x++) {
+    td[x].r += lut[ts[x].r - td[x].r];
+    td[x].g += lut[ts[x].g - td[x].g];
+    td[x].b += lut[ts[x].b - td[x].b];
+    if (mode == BLEND_ALPHA) {
+      td[x].a += lut[ts[x].a - td[x].a];
+    }
+  }
 }
 
-void bmp_destroy(Bitmap* bmp) {
-  free(bmp->data);
-  free(bmp);
+ALWAYS_INLINE void blit_row_c(Color* td, const Color* ts, int w, Color tint, const int mode, const int kind,
+                              const bool opaque) {
+  if (mode > BLEND_ALPHA) {
+    blit_mode_c(td, ts, w, tint, mode, kind, opaque, false);
+    return;
+  }
+  if (opaque && kind == TINT_NONE) {
+    blit_copy_c(td, ts, w, mode);
+    return;
+  }
+  if (opaque && kind == TINT_ALPHA) {
+    blit_lut_c(td, ts, w, tint, mode);
+    return;
+  }
+
+  int xr = kind == TINT_FULL ? EXPAND(tint.r) : 256;
+  int xg = kind == TINT_FULL ? EXPAND(tint.g) : 256;
+  int xb = kind == TINT_FULL ? EXPAND(tint.b) : 256;
+  int xa = kind == TINT_NONE ? 256 : EXPAND(tint.a);
+
+  for (int x = 0; x < w; x++) {
+    unsigned r = kind == TINT_FULL ? (xr * ts[x].r) >> 8 : ts[x].r;
+    unsigned g = kind == TINT_FULL ? (xg * ts[x].g) >> 8 : ts[x].g;
+    unsigned b = kind == TINT_FULL ? (xb * ts[x].b) >> 8 : ts[x].b;
+    unsigned a = opaque ? xa * 256 : xa * EXPAND(ts[x].a);
+    td[x].r += (unsigned char)((r - td[x].r) * a >> 16);
+    td[x].g += (unsigned char)((g - td[x].g) * a >> 16);
+    td[x].b += (unsigned char)((b - td[x].b) * a >> 16);
+    if (mode == BLEND_ALPHA) {
+      td[x].a += (unsigned char)((ts[x].a - td[x].a) * a >> 16);
+    }
+  }
 }
 
-void bmp_clip(Bitmap* bmp, int cx, int cy, int cw, int ch) {
-  bmp->cx = cx;
-  bmp->cy = cy;
-  bmp->cw = cw;
-  bmp->ch = ch;
+// mulhi_epi16 reads the factor as signed, so [afix] adds back what it drops.
+ALWAYS_INLINE __m128i blend_sse2(__m128i d, __m128i s, __m128i tint, __m128i xa, __m128i alo, __m128i afix,
+                                 __m128i amask, const int kind, const bool opaque) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i lo = alo;
+  __m128i fix = afix;
+  if (!opaque) {
+    __m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+    __m128i ea = _mm_sub_epi16(sa, _mm_cmpgt_epi16(sa, zero));
+    lo = _mm_mullo_epi16(ea, xa);
+    fix = _mm_sub_epi16(zero, _mm_or_si128(_mm_srli_epi16(lo, 15), _mm_mulhi_epu16(ea, xa)));
+  }
+  __m128i c = kind == TINT_FULL ? _mm_srli_epi16(_mm_mullo_epi16(s, tint), 8) : s;
+  __m128i diff = _mm_sub_epi16(c, d);
+  __m128i delta = _mm_add_epi16(_mm_mulhi_epi16(diff, lo), _mm_and_si128(diff, fix));
+  return _mm_add_epi16(d, _mm_and_si128(delta, amask));
 }
 
-void bmp_blit_mode(Bitmap* bmp, int mode) {
-  bmp->blit_mode = mode;
+ALWAYS_INLINE __m128i blend4_sse2(__m128i d, __m128i s, __m128i tint, __m128i xa, __m128i alo, __m128i afix,
+                                  __m128i amask, const int kind, const bool opaque) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i lo = blend_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero), tint, xa, alo, afix, amask, kind,
+                          opaque);
+  __m128i hi = blend_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero), tint, xa, alo, afix, amask, kind,
+                          opaque);
+  return _mm_packus_epi16(lo, hi);
 }
 
-void bmp_clear(Bitmap* bmp, Color color) {
-  int count = bmp->w * bmp->h;
-  int n;
-  for (n = 0; n < count; n++)
-    bmp->data[n] = color;
+// blit_mode_c on two unpacked pixels, with [ca] the coverage of an opaque source.
+ALWAYS_INLINE __m128i mode_sse2(__m128i d, __m128i s, __m128i tint, __m128i xa2, __m128i ca, __m128i cmask,
+                                const int mode, const int kind, const bool opaque, const bool premultiplied) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = ca;
+  __m128i p;
+  if (premultiplied) {
+    p = kind == TINT_NONE ? s : _mm_srli_epi16(_mm_mullo_epi16(s, tint), 8);
+    if (!opaque) {
+      a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p, 0xff), 0xff);
+      a = _mm_sub_epi16(a, _mm_cmpgt_epi16(a, zero));
+    }
+  } else {
+    __m128i c = kind == TINT_FULL ? _mm_srli_epi16(_mm_mullo_epi16(s, tint), 8) : s;
+    if (!opaque) {
+      __m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+      __m128i ea = _mm_sub_epi16(sa, _mm_cmpgt_epi16(sa, zero));
+      a = _mm_mulhi_epu16(_mm_slli_epi16(ea, 7), xa2);
+    }
+    p = _mm_srli_epi16(_mm_mullo_epi16(c, a), 8);
+  }
+
+  __m128i r;
+  switch (mode) {
+    case BLEND_ADD:
+      r = _mm_add_epi16(d, p);
+      break;
+    case BLEND_SUBTRACT:
+      r = _mm_sub_epi16(d, p);
+      break;
+    case BLEND_SCREEN: {
+      __m128i ed = _mm_sub_epi16(d, _mm_cmpgt_epi16(d, zero));
+      r = _mm_add_epi16(d, _mm_sub_epi16(p, _mm_srli_epi16(_mm_mullo_epi16(p, ed), 8)));
+      break;
+    }
+    case BLEND_MULTIPLY:
+    default: {
+      __m128i full = _mm_set1_epi16(256);
+      __m128i ep = _mm_sub_epi16(p, _mm_cmpgt_epi16(p, zero));
+      __m128i f = _mm_min_epi16(_mm_add_epi16(_mm_sub_epi16(full, a), ep), full);
+      r = _mm_srli_epi16(_mm_mullo_epi16(d, f), 8);
+      break;
+    }
+  }
+  return _mm_or_si128(_mm_and_si128(r, cmask), _mm_andnot_si128(cmask, d));
 }
 
-Color bmp_get(Bitmap* bmp, int x, int y) {
-  Color empty = {0, 0, 0, 0};
-  if (x >= 0 && y >= 0 && x < bmp->w && y < bmp->h)
-    return bmp->data[y * bmp->w + x];
-  return empty;
+ALWAYS_INLINE void blit_mode_sse2(Color* td, const Color* ts, int w, Color tint, const int mode, const int kind,
+                                  const bool opaque, const bool premultiplied) {
+  short xa = kind == TINT_NONE ? 256 : EXPAND(tint.a);
+  short xr = kind == TINT_FULL ? EXPAND(tint.r) : 256;
+  short xg = kind == TINT_FULL ? EXPAND(tint.g) : 256;
+  short xb = kind == TINT_FULL ? EXPAND(tint.b) : 256;
+  if (premultiplied) {
+    xr = xr * xa >> 8;
+    xg = xg * xa >> 8;
+    xb = xb * xa >> 8;
+  }
+  __m128i zero = _mm_setzero_si128();
+  __m128i vtint = _mm_setr_epi16(xb, xg, xr, xa, xb, xg, xr, xa);
+  __m128i xa2 = _mm_set1_epi16((short)(xa * 2));
+  __m128i ca = _mm_set1_epi16(premultiplied ? EXPAND(255 * xa >> 8) : xa);
+  __m128i cmask = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+
+  int x = 0;
+  for (; x + 4 <= w; x += 4) {
+    __m128i d = _mm_loadu_si128((__m128i*)&td[x]);
+    __m128i s = _mm_loadu_si128((const __m128i*)&ts[x]);
+    __m128i lo = mode_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero), vtint, xa2, ca, cmask, mode, kind,
+                           opaque, premultiplied);
+    __m128i hi = mode_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero), vtint, xa2, ca, cmask, mode, kind,
+                           opaque, premultiplied);
+    _mm_storeu_si128((__m128i*)&td[x], _mm_packus_epi16(lo, hi));
+  }
+  blit_mode_c(td + x, ts + x, w - x, tint, mode, kind, opaque, premultiplied);
 }
 
-void bmp_plot(Bitmap* bmp, int x, int y, Color color) {
-  int xa, i, a;
+ALWAYS_INLINE void blit_row_sse2(Color* td, const Color* ts, int w, Color tint, const int mode, const int kind,
+                                 const bool opaque) {
+  if (mode > BLEND_ALPHA) {
+    blit_mode_sse2(td, ts, w, tint, mode, kind, opaque, false);
+    return;
+  }
+  if (opaque && kind == TINT_NONE) {
+    blit_copy_c(td, ts, w, mode);
+    return;
+  }
 
-  int cx = bmp->cx;
-  int cy = bmp->cy;
-  int cw = bmp->cw >= 0 ? bmp->cw : bmp->w;
-  int ch = bmp->ch >= 0 ? bmp->ch : bmp->h;
+  short xb = kind == TINT_FULL ? EXPAND(tint.b) : 256;
+  short xg = kind == TINT_FULL ? EXPAND(tint.g) : 256;
+  short xr = kind == TINT_FULL ? EXPAND(tint.r) : 256;
+  int xa = kind == TINT_NONE ? 256 : EXPAND(tint.a);
+  short am = mode == BLEND_ALPHA ? -1 : 0;
+  __m128i vtint = _mm_setr_epi16(xb, xg, xr, 256, xb, xg, xr, 256);
+  __m128i vxa = _mm_set1_epi16((short)xa);
+  __m128i alo = _mm_set1_epi16((short)(xa * 256));
+  __m128i afix = _mm_set1_epi16(xa * 256 >= 32768 ? -1 : 0);
+  __m128i amask = _mm_setr_epi16(-1, -1, -1, am, -1, -1, -1, am);
 
-  if (x >= cx && y >= cy && x < cx + cw && y < cy + ch) {
-    xa = EXPAND(color.a);
-    a = xa * xa;
-    i = y * bmp->w + x;
+  int x = 0;
+  for (; x + 8 <= w; x += 8) {
+    __m128i d0 = _mm_loadu_si128((__m128i*)&td[x]);
+    __m128i d1 = _mm_loadu_si128((__m128i*)&td[x + 4]);
+    __m128i s0 = _mm_loadu_si128((const __m128i*)&ts[x]);
+    __m128i s1 = _mm_loadu_si128((const __m128i*)&ts[x + 4]);
+    _mm_storeu_si128((__m128i*)&td[x], blend4_sse2(d0, s0, vtint, vxa, alo, afix, amask, kind, opaque));
+    _mm_storeu_si128((__m128i*)&td[x + 4], blend4_sse2(d1, s1, vtint, vxa, alo, afix, amask, kind, opaque));
+  }
+  for (; x + 4 <= w; x += 4) {
+    __m128i d = _mm_loadu_si128((__m128i*)&td[x]);
+    __m128i s = _mm_loadu_si128((const __m128i*)&ts[x]);
+    _mm_storeu_si128((__m128i*)&td[x], blend4_sse2(d, s, vtint, vxa, alo, afix, amask, kind, opaque));
+  }
+  blit_row_c(td + x, ts + x, w - x, tint, mode, kind, opaque);
+}
 
-    bmp->data[i].r += (unsigned char)((color.r - bmp->data[i].r) * a >> 16);
-    bmp->data[i].g += (unsigned char)((color.g - bmp->data[i].g) * a >> 16);
-    bmp->data[i].b += (unsigned char)((color.b - bmp->data[i].b) * a >> 16);
-    bmp->data[i].a += (bmp->blit_mode) * (unsigned char)((color.a - bmp->data[i].a) * a >> 16);
+TARGET_AVX2 ALWAYS_INLINE __m256i blend_avx2(__m256i d, __m256i s, __m256i tint, __m256i xa, __m256i alo,
+                                             __m256i afix, __m256i amask, const int kind, const bool opaque) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i lo = alo;
+  __m256i fix = afix;
+  if (!opaque) {
+    __m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xff), 0xff);
+    __m256i ea = _mm256_sub_epi16(sa, _mm256_cmpgt_epi16(sa, zero));
+    lo = _mm256_mullo_epi16(ea, xa);
+    fix = _mm256_sub_epi16(zero, _mm256_or_si256(_mm256_srli_epi16(lo, 15), _mm256_mulhi_epu16(ea, xa)));
   }
+  __m256i c = kind == TINT_FULL ? _mm256_srli_epi16(_mm256_mullo_epi16(s, tint), 8) : s;
+  __m256i diff = _mm256_sub_epi16(c, d);
+  __m256i delta = _mm256_add_epi16(_mm256_mulhi_epi16(diff, lo), _mm256_and_si256(diff, fix));
+  return _mm256_add_epi16(d, _mm256_and_si256(delta, amask));
 }
 
-void bmp_line(Bitmap* bmp, int x0, int y0, int x1, int y1, Color color) {
-  int sx, sy, dx, dy, err, e2;
-  dx = abs(x1 - x0);
-  dy = abs(y1 - y0);
-  if (x0 < x1)
-    sx = 1;
-  else
-    sx = -1;
-  if (y0 < y1)
-    sy = 1;
-  else
-    sy = -1;
-  err = dx - dy;
+TARGET_AVX2 ALWAYS_INLINE __m256i blend8_avx2(__m256i d, __m256i s, __m256i tint, __m256i xa, __m256i alo,
+                                              __m256i afix, __m256i amask, const int kind, const bool opaque) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i lo = blend_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero), tint, xa, alo, afix, amask,
+                          kind, opaque);
+  __m256i hi = blend_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero), tint, xa, alo, afix, amask,
+                          kind, opaque);
+  return _mm256_packus_epi16(lo, hi);
+}
 
-  do {
-    bmp_plot(bmp, x0, y0, color);
-    e2 = 2 * err;
-    if (e2 > -dy) {
-      err -= dy;
-      x0 += sx;
-    }
-    if (e2 < dx) {
-      err += dx;
-      y0 += sy;
+TARGET_AVX2 ALWAYS_INLINE void blit_row_avx2(Color* td, const Color* ts, int w, Color tint, const int mode,
+                                             const int kind, const bool opaque) {
+  if (mode > BLEND_ALPHA) {
+    blit_mode_sse2(td, ts, w, tint, mode, kind, opaque, false);
+    return;
+  }
+  if (opaque && kind == TINT_NONE) {
+    blit_copy_c(td, ts, w, mode);
+    return;
+  }
+
+  short xb = kind == TINT_FULL ? EXPAND(tint.b) : 256;
+  short xg = kind == TINT_FULL ? EXPAND(tint.g) : 256;
+  short xr = kind == TINT_FULL ? EXPAND(tint.r) : 256;
+  int xa = kind == TINT_NONE ? 256 : EXPAND(tint.a);
+  short am = mode == BLEND_ALPHA ? -1 : 0;
+  __m256i vtint = _mm256_setr_epi16(xb, xg, xr, 256, xb, xg, xr, 256, xb, xg, xr, 256, xb, xg, xr, 256);
+  __m256i vxa = _mm256_set1_epi16((short)xa);
+  __m256i alo = _mm256_set1_epi16((short)(xa * 256));
+  __m256i afix = _mm256_set1_epi16(xa * 256 >= 32768 ? -1 : 0);
+  __m256i amask = _mm256_setr_epi16(-1, -1, -1, am, -1, -1, -1, am, -1, -1, -1, am, -1, -1, -1, am);
+
+  int x = 0;
+  for (; x + 16 <= w; x += 16) {
+    __m256i d0 = _mm256_loadu_si256((__m256i*)&td[x]);
+    __m256i d1 = _mm256_loadu_si256((__m256i*)&td[x + 8]);
+    __m256i s0 = _mm256_loadu_si256((const __m256i*)&ts[x]);
+    __m256i s1 = _mm256_loadu_si256((const __m256i*)&ts[x + 8]);
+    _mm256_storeu_si256((__m256i*)&td[x], blend8_avx2(d0, s0, vtint, vxa, alo, afix, amask, kind, opaque));
+    _mm256_storeu_si256((__m256i*)&td[x + 8], blend8_avx2(d1, s1, vtint, vxa, alo, afix, amask, kind, opaque));
+  }
+  for (; x + 8 <= w; x += 8) {
+    __m256i d = _mm256_loadu_si256((__m256i*)&td[x]);
+    __m256i s = _mm256_loadu_si256((const __m256i*)&ts[x]);
+    _mm256_storeu_si256((__m256i*)&td[x], blend8_avx2(d, s, vtint, vxa, alo, afix, amask, kind, opaque));
+  }
+  blit_row_sse2(td + x, ts + x, w - x, tint, mode, kind, opaque);
+}
+
+// dst = src * m + dst * (1 - a), with the tint and its alpha folded into m.
+ALWAYS_INLINE void blit_row_pm_c(Color* td, const Color* ts, int w, Color tint, const int mode, const int kind,
+                                 const bool opaque) {
+  if (mode > BLEND_ALPHA) {
+    blit_mode_c(td, ts, w, tint, mode, kind, opaque, true);
+    return;
+  }
+  if (opaque && kind == TINT_NONE) {
+    blit_copy_c(td, ts, w, mode);
+    return;
+  }
+
+  int xa = kind == TINT_NONE ? 256 : EXPAND(tint.a);
+  int mr = kind == TINT_FULL ? EXPAND(tint.r) * xa >> 8 : xa;
+  int mg = kind == TINT_FULL ? EXPAND(tint.g) * xa >> 8 : xa;
+  int mb = kind == TINT_FULL ? EXPAND(tint.b) * xa >> 8 : xa;
+
+  for (int x = 0; x < w; x++) {
+    int a = opaque ? 255 * xa >> 8 : ts[x].a * xa >> 8;
+    int inv = 256 - EXPAND(a);
+    int r = (ts[x].r * mr >> 8) + (td[x].r * inv >> 8);
+    int g = (ts[x].g * mg >> 8) + (td[x].g * inv >> 8);
+    int b = (ts[x].b * mb >> 8) + (td[x].b * inv >> 8);
+    td[x].r = (unsigned char)(r > 255 ? 255 : r);
+    td[x].g = (unsigned char)(g > 255 ? 255 : g);
+    td[x].b = (unsigned char)(b > 255 ? 255 : b);
+    if (mode == BLEND_ALPHA) {
+      a += td[x].a * inv >> 8;
+      td[x].a = (unsigned char)(a > 255 ? 255 : a);
     }
-  } while (x0 != x1 || y0 != y1);
+  }
 }
 
-void bmp_rect(Bitmap* bmp, int x, int y, int w, int h, Color color) {
-  x += 1;
-  y += 1;
-  w -= 2;
-  h -= 2;
+ALWAYS_INLINE __m128i over_sse2(__m128i d, __m128i s, __m128i m, __m128i cinv, __m128i amask, const int kind,
+                                const bool opaque) {
+  __m128i c = kind == TINT_NONE ? s : _mm_srli_epi16(_mm_mullo_epi16(s, m), 8);
+  __m128i inv = cinv;
+  if (!opaque) {
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, 0xff), 0xff);
+    inv = _mm_add_epi16(_mm_sub_epi16(_mm_set1_epi16(256), a), _mm_cmpgt_epi16(a, _mm_setzero_si128()));
+  }
+  __m128i res = _mm_add_epi16(c, _mm_srli_epi16(_mm_mullo_epi16(d, inv), 8));
+  return _mm_or_si128(_mm_and_si128(res, amask), _mm_andnot_si128(amask, d));
+}
 
-  int cx = bmp->cx;
-  int cy = bmp->cy;
-  int cw = bmp->cw >= 0 ? bmp->cw : bmp->w;
-  int ch = bmp->ch >= 0 ? bmp->ch : bmp->h;
+ALWAYS_INLINE __m128i over4_sse2(__m128i d, __m128i s, __m128i m, __m128i cinv, __m128i amask, const int kind,
+                                 const bool opaque) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i lo = over_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero), m, cinv, amask, kind, opaque);
+  __m128i hi = over_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero), m, cinv, amask, kind, opaque);
+  return _mm_packus_epi16(lo, hi);
+}
 
-  if (x < cx) {
-    w += (x - cx);
-    x = cx;
+ALWAYS_INLINE void blit_row_pm_sse2(Color* td, const Color* ts, int w, Color tint, const int mode, const int kind,
+                                    const bool opaque) {
+  if (mode > BLEND_ALPHA) {
+    blit_mode_sse2(td, ts, w, tint, mode, kind, opaque, true);
+    return;
   }
-  if (y < cy) {
-    h += (y - cy);
-    y = cy;
+  if (opaque && kind == TINT_NONE) {
+    blit_copy_c(td, ts, w, mode);
+    return;
   }
-  if (x + w > cx + cw) {
-    w -= (x + w) - (cx + cw);
+
+  short xa = kind == TINT_NONE ? 256 : EXPAND(tint.a);
+  short mr = kind == TINT_FULL ? EXPAND(tint.r) * xa >> 8 : xa;
+  short mg = kind == TINT_FULL ? EXPAND(tint.g) * xa >> 8 : xa;
+  short mb = kind == TINT_FULL ? EXPAND(tint.b) * xa >> 8 : xa;
+  short am = mode == BLEND_ALPHA ? -1 : 0;
+  __m128i m = _mm_setr_epi16(mb, mg, mr, xa, mb, mg, mr, xa);
+  __m128i cinv = _mm_set1_epi16((short)(256 - EXPAND(255 * xa >> 8)));
+  __m128i amask = _mm_setr_epi16(-1, -1, -1, am, -1, -1, -1, am);
+
+  int x = 0;
+  for (; x + 8 <= w; x += 8) {
+    __m128i d0 = _mm_loadu_si128((__m128i*)&td[x]);
+    __m128i d1 = _mm_loadu_si128((__m128i*)&td[x + 4]);
+    __m128i s0 = _mm_loadu_si128((const __m128i*)&ts[x]);
+    __m128i s1 = _mm_loadu_si128((const __m128i*)&ts[x + 4]);
+    _mm_storeu_si128((__m128i*)&td[x], over4_sse2(d0, s0, m, cinv, amask, kind, opaque));
+    _mm_storeu_si128((__m128i*)&td[x + 4], over4_sse2(d1, s1, m, cinv, amask, kind, opaque));
   }
-  if (y + h > cy + ch) {
-    h -= (y + h) - (cy + ch);
+  for (; x + 4 <= w; x += 4) {
+    __m128i d = _mm_loadu_si128((__m128i*)&td[x]);
+    __m128i s = _mm_loadu_si128((const __m128i*)&ts[x]);
+    _mm_storeu_si128((__m128i*)&td[x], over4_sse2(d, s, m, cinv, amask, kind, opaque));
   }
-  if (w <= 0 || h <= 0)
-    return;
+  blit_row_pm_c(td + x, ts + x, w - x, tint, mode, kind, opaque);
+}
 
-  Color* td = &bmp->data[y * bmp->w + x];
-  int dt = bmp->w;
-  int xa = EXPAND(color.a);
-  int a = xa * xa;
+TARGET_AVX2 ALWAYS_INLINE __m256i over_avx2(__m256i d, __m256i s, __m256i m, __m256i cinv, __m256i amask,
+                                            const int kind, const bool opaque) {
+  __m256i c = kind == TINT_NONE ? s : _mm256_srli_epi16(_mm256_mullo_epi16(s, m), 8);
+  __m256i inv = cinv;
+  if (!opaque) {
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, 0xff), 0xff);
+    inv = _mm256_add_epi16(_mm256_sub_epi16(_mm256_set1_epi16(256), a), _mm256_cmpgt_epi16(a, _mm256_setzero_si256()));
+  }
+  __m256i res = _mm256_add_epi16(c, _mm256_srli_epi16(_mm256_mullo_epi16(d, inv), 8));
+  return _mm256_or_si256(_mm256_and_si256(res, amask), _mm256_andnot_si256(amask, d));
+}
 
-  do {
-    for (int i = 0; i < w; i++) {
-      td[i].r += (unsigned char)((color.r - td[i].r) * a >> 16);
-      td[i].g += (unsigned char)((color.g - td[i].g) * a >> 16);
-      td[i].b += (unsigned char)((color.b - td[i].b) * a >> 16);
-      td[i].a += (bmp->blit_mode) * (unsigned char)((color.a - td[i].a) * a >> 16);
-    }
-    td += dt;
-  } while (--h);
+TARGET_AVX2 ALWAYS_INLINE __m256i over8_avx2(__m256i d, __m256i s, __m256i m, __m256i cinv, __m256i amask,
+                                             const int kind, const bool opaque) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i lo = over_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero), m, cinv, amask, kind, opaque);
+  __m256i hi = over_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero), m, cinv, amask, kind, opaque);
+  return _mm256_packus_epi16(lo, hi);
 }
 
-void bmp_rect_line(Bitmap* bmp, int x, int y, int w, int h, Color color) {
-  int x1, y1;
-  if (w <= 0 || h <= 0) {
+TARGET_AVX2 ALWAYS_INLINE void blit_row_pm_avx2(Color* td, const Color* ts, int w, Color tint, const int mode,
+                                                const int kind, const bool opaque) {
+  if (mode > BLEND_ALPHA) {
+    blit_mode_sse2(td, ts, w, tint, mode, kind, opaque, true);
+    return;
+  }
+  if (opaque && kind == TINT_NONE) {
+    blit_copy_c(td, ts, w, mode);
     return;
   }
 
-  if (w == 1) {
-    bmp_line(bmp, x, y, x, y + h, color);
-  } else if (h == 1) {
-    bmp_line(bmp, x, y, x + w, y, color);
-  } else {
-    x1 = x + w - 1;
-    y1 = y + h - 1;
-    bmp_line(bmp, x, y, x1, y, color);
-    bmp_line(bmp, x1, y, x1, y1, color);
-    bmp_line(bmp, x1, y1, x, y1, color);
-    bmp_line(bmp, x, y1, x, y, color);
+  short xa = kind == TINT_NONE ? 256 : EXPAND(tint.a);
+  short mr = kind == TINT_FULL ? EXPAND(tint.r) * xa >> 8 : xa;
+  short mg = kind == TINT_FULL ? EXPAND(tint.g) * xa >> 8 : xa;
+  short mb = kind == TINT_FULL ? EXPAND(tint.b) * xa >> 8 : xa;
+  short am = mode == BLEND_ALPHA ? -1 : 0;
+  __m256i m = _mm256_setr_epi16(mb, mg, mr, xa, mb, mg, mr, xa, mb, mg, mr, xa, mb, mg, mr, xa);
+  __m256i cinv = _mm256_set1_epi16((short)(256 - EXPAND(255 * xa >> 8)));
+  __m256i amask = _mm256_setr_epi16(-1, -1, -1, am, -1, -1, -1, am, -1, -1, -1, am, -1, -1, -1, am);
+
+  int x = 0;
+  for (; x + 16 <= w; x += 16) {
+    __m256i d0 = _mm256_loadu_si256((__m256i*)&td[x]);
+    __m256i d1 = _mm256_loadu_si256((__m256i*)&td[x + 8]);
+    __m256i s0 = _mm256_loadu_si256((const __m256i*)&ts[x]);
+    __m256i s1 = _mm256_loadu_si256((const __m256i*)&ts[x + 8]);
+    _mm256_storeu_si256((__m256i*)&td[x], over8_avx2(d0, s0, m, cinv, amask, kind, opaque));
+    _mm256_storeu_si256((__m256i*)&td[x + 8], over8_avx2(d1, s1, m, cinv, amask, kind, opaque));
   }
+  for (; x + 8 <= w; x += 8) {
+    __m256i d = _mm256_loadu_si256((__m256i*)&td[x]);
+    __m256i s = _mm256_loadu_si256((const __m256i*)&ts[x]);
+    _mm256_storeu_si256((__m256i*)&td[x], over8_avx2(d, s, m, cinv, amask, kind, opaque));
+  }
+  blit_row_pm_sse2(td + x, ts + x, w - x, tint, mode, kind, opaque);
 }
 
-void bmp_blit(Bitmap* dst, Bitmap* src, int dx, int dy, int sx, int sy, int w, int h) {
-  int cw = dst->cw >= 0 ? dst->cw : dst->w;
-  int ch = dst->ch >= 0 ? dst->ch : dst->h;
+// Expands one row kernel per (source opacity, tint kind, blit mode) from a
+// generic row function, plus the table blit_select indexes into.
+#define BLIT_KERNEL(ATTR, NAME, IMPL, OPAQUE, KIND, MODE)         \
+  ATTR void NAME(Color* td, const Color* ts, int w, Color tint) { \
+    IMPL(td, ts, w, tint, MODE, KIND, OPAQUE);                    \
+  }
 
-  CLIP();
+#define BLIT_KERNEL_MODES(ATTR, NAME, IMPL, OPAQUE, KIND)                  \
+  BLIT_KERNEL(ATTR, NAME##_keep, IMPL, OPAQUE, KIND, KEEP_ALPHA)           \
+  BLIT_KERNEL(ATTR, NAME##_blend, IMPL, OPAQUE, KIND, BLEND_ALPHA)         \
+  BLIT_KERNEL(ATTR, NAME##_add, IMPL, OPAQUE, KIND, BLEND_ADD)             \
+  BLIT_KERNEL(ATTR, NAME##_multiply, IMPL, OPAQUE, KIND, BLEND_MULTIPLY)   \
+  BLIT_KERNEL(ATTR, NAME##_screen, IMPL, OPAQUE, KIND, BLEND_SCREEN)       \
+  BLIT_KERNEL(ATTR, NAME##_subtract, IMPL, OPAQUE, KIND, BLEND_SUBTRACT)
+
+#define BLIT_MODES(NAME) {NAME##_keep, NAME##_blend, NAME##_add, NAME##_multiply, NAME##_screen, NAME##_subtract}
+
+#define BLIT_KERNELS(ATTR, TABLE, IMPL)                                                                         \
+  BLIT_KERNEL_MODES(ATTR, TABLE##_translucent_none, IMPL, false, TINT_NONE)                                     \
+  BLIT_KERNEL_MODES(ATTR, TABLE##_translucent_alpha, IMPL, false, TINT_ALPHA)                                   \
+  BLIT_KERNEL_MODES(ATTR, TABLE##_translucent_full, IMPL, false, TINT_FULL)                                     \
+  BLIT_KERNEL_MODES(ATTR, TABLE##_opaque_none, IMPL, true, TINT_NONE)                                           \
+  BLIT_KERNEL_MODES(ATTR, TABLE##_opaque_alpha, IMPL, true, TINT_ALPHA)                                         \
+  BLIT_KERNEL_MODES(ATTR, TABLE##_opaque_full, IMPL, true, TINT_FULL)                                           \
+  BlitRowFn TABLE[2][3][NUM_BLIT_MODES] = {                                                                     \
+      {BLIT_MODES(TABLE##_translucent_none), BLIT_MODES(TABLE##_translucent_alpha),                             \
+       BLIT_MODES(TABLE##_translucent_full)},                                                                   \
+      {BLIT_MODES(TABLE##_opaque_none), BLIT_MODES(TABLE##_opaque_alpha), BLIT_MODES(TABLE##_opaque_full)},     \
+  };
+
+BLIT_KERNELS(, blit_kernels_c, blit_row_c)
+BLIT_KERNELS(, blit_kernels_sse2, blit_row_sse2)
+BLIT_KERNELS(TARGET_AVX2, blit_kernels_avx2, blit_row_avx2)
+BLIT_KERNELS(, blit_kernels_pm_c, blit_row_pm_c)
+BLIT_KERNELS(, blit_kernels_pm_sse2, blit_row_pm_sse2)
+BLIT_KERNELS(TARGET_AVX2, blit_kernels_pm_avx2, blit_row_pm_avx2)
+
+// Indexed by [source is opaque][tint kind][blit mode].
+BlitRowFn (*blit_kernels)[3][NUM_BLIT_MODES] = blit_kernels_c;
+BlitRowFn (*blit_kernels_pm)[3][NUM_BLIT_MODES] = blit_kernels_pm_c;
+
+int tint_kind(Color tint) {
+  if (tint.r == 0xff && tint.g == 0xff && tint.b == 0xff) {
+    return tint.a == 0xff ? TINT_NONE : TINT_ALPHA;
+  }
+  return TINT_FULL;
+}
 
-  Color* ts = &src->data[sy * src->w + sx];
-  Color* td = &dst->data[dy * dst->w + dx];
-  int st = src->w;
-  int dt = dst->w;
-  do {
-    memcpy(td, ts, w * sizeof(Color));
-    ts += st;
-    td += dt;
-  } while (--h);
+void blit_init(void) {
+  for (int a = 0; a < 256; a++) {
+    for (int d = -255; d <= 255; d++) {
+      blend_lut[a][255 + d] = (unsigned char)(d * EXPAND(a) >> 8);
+    }
+  }
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2")) {
+    blit_kernels = blit_kernels_sse2;
+    blit_kernels_pm = blit_kernels_pm_sse2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    blit_kernels = blit_kernels_avx2;
+    blit_kernels_pm = blit_kernels_pm_avx2;
+  }
 }
 
-void bmp_blit_tint(Bitmap* dst, Bitmap* src, int dx, int dy, int sx, int sy, int w, int h, Color tint) {
-  int cw = dst->cw >= 0 ? dst->cw : dst->w;
-  int ch = dst->ch >= 0 ? dst->ch : dst->h;
+// BITMAP OPERATIONS
 
-  CLIP();
+// Without room for a span table, bitmaps that are not opaque blend everywhere.
+void bmp_classify(Bitmap* bmp) {
+  bmp = bmp->root;
+  int bw = (bmp->w + SPAN_SIZE - 1) / SPAN_SIZE;
+  bool opaque = true;
+  bool binary = true;
 
-  int xr = EXPAND(tint.r);
-  int xg = EXPAND(tint.g);
-  int xb = EXPAND(tint.b);
-  int xa = EXPAND(tint.a);
+  free(bmp->spans);
+  bmp->spans = (unsigned char*)malloc(bw * bmp->h);
 
-  Color* ts = &src->data[sy * src->w + sx];
-  Color* td = &dst->data[dy * dst->w + dx];
-  int st = src->w;
-  int dt = dst->w;
-  do {
-    for (int x = 0; x < w; x++) {
-      unsigned r = (xr * ts[x].r) >> 8;
-      unsigned g = (xg * ts[x].g) >> 8;
-      unsigned b = (xb * ts[x].b) >> 8;
-      unsigned a = xa * EXPAND(ts[x].a);
-      td[x].r += (unsigned char)((r - td[x].r) * a >> 16);
-      td[x].g += (unsigned char)((g - td[x].g) * a >> 16);
-      td[x].b += (unsigned char)((b - td[x].b) * a >> 16);
-      td[x].a += (dst->blit_mode) * (unsigned char)((ts[x].a - td[x].a) * a >> 16);
+  for (int y = 0; y < bmp->h; y++) {
+    Color* row = &bmp->data[y * bmp->stride];
+    for (int b = 0; b < bw; b++) {
+      int x1 = (b + 1) * SPAN_SIZE < bmp->w ? (b + 1) * SPAN_SIZE : bmp->w;
+      int kind = SPAN_KIND(row[b * SPAN_SIZE].a);
+      for (int x = b * SPAN_SIZE; x < x1; x++) {
+        int k = SPAN_KIND(row[x].a);
+        opaque &= k == SPAN_OPAQUE;
+        binary &= k != SPAN_BLEND;
+        if (k != kind) {
+          kind = SPAN_BLEND;
+        }
+      }
+      if (bmp->spans) {
+        bmp->spans[y * bw + b] = (unsigned char)kind;
+      }
     }
-    ts += st;
-    td += dt;
-  } while (--h);
+  }
+
+  bmp->alpha_class = opaque ? ALPHA_OPAQUE : binary && bmp->spans ? ALPHA_BINARY : ALPHA_TRANSLUCENT;
+  bmp->dirty = false;
+  if (opaque) {
+    free(bmp->spans);
+    bmp->spans = nullptr;
+  }
 }
 
-void bmp_blit_alpha(Bitmap* dst, Bitmap* src, int dx, int dy, int sx, int sy, int w, int h, float alpha) {
-  alpha = (alpha < 0) ? 0 : (alpha > 1 ? 1 : alpha);
-  bmp_blit_tint(dst, src, dx, dy, sx, sy, w, h, new_color(0xff, 0xff, 0xff, (unsigned char)(alpha * 255)));
+Bitmap* bmp_create(int w, int h) {
+  int stride = (w * (int)sizeof(Color) + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN / (int)sizeof(Color);
+  Bitmap* bmp = (Bitmap*)calloc(1, sizeof(Bitmap) + ROW_ALIGN - 1 + (size_t)stride * h * sizeof(Color));
+  if (!bmp) {
+    return nullptr;
+  }
+  bmp->w = w;
+  bmp->h = h;
+  bmp->stride = stride;
+  bmp->root = bmp;
+  bmp->refs = 1;
+  bmp->cw = -1;
+  bmp->ch = -1;
+  bmp->data = (Color*)(((uintptr_t)(bmp + 1) + ROW_ALIGN - 1) & ~(uintptr_t)(ROW_ALIGN - 1));
+  bmp->blit_mode = BLEND_ALPHA;
+  bmp->dirty = true;
+  return bmp;
 }
 
-// FONTS
+void bmp_premultiply(Bitmap* bmp) {
+  if (bmp->premultiplied) {
+    return;
+  }
+  for (int y = 0; y < bmp->h; y++) {
+    Color* row = &bmp->data[y * bmp->stride];
+    for (int x = 0; x < bmp->w; x++) {
+      int a = EXPAND(row[x].a);
+      row[x].r = (unsigned char)(row[x].r * a >> 8);
+      row[x].g = (unsigned char)(row[x].g * a >> 8);
+      row[x].b = (unsigned char)(row[x].b * a >> 8);
+    }
+  }
+  bmp->premultiplied = true;
+}
 
-typedef struct {
-  int code, x, y, w, h;
-} Glyph;
+Bitmap* bmp_load(void* data, int len, bool premultiplied) {
+  int w, h;
+  unsigned char* img_data = stbi_load_from_memory(data, len, &w, &h, nullptr, 4);
+  if (!img_data) {
+    return nullptr;
+  }
+
+  Bitmap* bmp = bmp_create(w, h);
+  if (!bmp) {
+    stbi_image_free(img_data);
+    return nullptr;
+  }
+
+  for (int y = 0; y < bmp->h; y++) {
+    for (int x = 0; x < bmp->w; x++) {
+      int src_i = (y * bmp->w + x) * 4;
+      int dst_i = y * bmp->stride + x;
+      bmp->data[dst_i] = new_color(img_data[src_i], img_data[src_i + 1], img_data[src_i + 2], img_data[src_i + 3]);
+    }
+  }
+
+  stbi_image_free(img_data);
+  if (premultiplied) {
+    bmp_premultiply(bmp);
+  }
+  bmp_classify(bmp);
+  return bmp;
+}
+
+Bitmap* bmp_view(Bitmap* bmp, int x, int y, int w, int h) {
+  if (x < 0) {
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (x + w > bmp->w) {
+    w = bmp->w - x;
+  }
+  if (y + h > bmp->h) {
+    h = bmp->h - y;
+  }
+  if (w < 0 || h < 0) {
+    w = h = 0;
+  }
+
+  Bitmap* view = (Bitmap*)calloc(1, sizeof(Bitmap));
+  if (!view) {
+    return nullptr;
+  }
+  view->w = w;
+  view->h = h;
+  view->stride = bmp->stride;
+  view->cw = -1;
+  view->ch = -1;
+  view->data = &bmp->data[y * bmp->stride + x];
+  view->blit_mode = bmp->blit_mode;
+  view->premultiplied = bmp->premultiplied;
+  view->root = bmp->root;
+  view->ox = bmp->ox + x;
+  view->oy = bmp->oy + y;
+  view->refs = 1;
+  view->root->refs++;
+  return view;
+}
+
+void bmp_destroy(Bitmap* bmp) {
+  if (--bmp->refs > 0) {
+    return;
+  }
+  if (bmp->root != bmp) {
+    bmp_destroy(bmp->root);
+  } else {
+    free(bmp->spans);
+    free(bmp->damage);
+    free(bmp->coverage);
+    free(bmp->blocks);
+  }
+  free(bmp);
+}
+
+void bmp_clip(Bitmap* bmp, int cx, int cy, int cw, int ch) {
+  bmp->cx = cx;
+  bmp->cy = cy;
+  bmp->cw = cw;
+  bmp->ch = ch;
+}
+
+void bmp_blit_mode(Bitmap* bmp, int mode) {
+  bmp->blit_mode = mode;
+}
+
+int damage_area(int x0, int y0, int x1, int y1) {
+  return (x1 - x0) * (y1 - y0);
+}
+
+void damage_add(Damage* damage, int x0, int y0, int x1, int y1) {
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+
+  int i = 0;
+  while (i < damage->num_rects) {
+    DamageRect* r = &damage->rects[i];
+    int ux0 = x0 < r->x0 ? x0 : r->x0;
+    int uy0 = y0 < r->y0 ? y0 : r->y0;
+    int ux1 = x1 > r->x1 ? x1 : r->x1;
+    int uy1 = y1 > r->y1 ? y1 : r->y1;
+    if (damage_area(ux0, uy0, ux1, uy1) <=
+        damage_area(x0, y0, x1, y1) + damage_area(r->x0, r->y0, r->x1, r->y1) + DAMAGE_SLACK) {
+      // The union may now reach rectangles already passed over.
+      x0 = ux0;
+      y0 = uy0;
+      x1 = ux1;
+      y1 = uy1;
+      *r = damage->rects[--damage->num_rects];
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+
+  if (damage->num_rects == MAX_DAMAGE) {
+    int best = 0;
+    int best_cost = INT_MAX;
+    for (i = 0; i < damage->num_rects; i++) {
+      DamageRect* r = &damage->rects[i];
+      int cost = damage_area(x0 < r->x0 ? x0 : r->x0, y0 < r->y0 ? y0 : r->y0, x1 > r->x1 ? x1 : r->x1,
+                             y1 > r->y1 ? y1 : r->y1) -
+                 damage_area(r->x0, r->y0, r->x1, r->y1);
+      if (cost < best_cost) {
+        best = i;
+        best_cost = cost;
+      }
+    }
+    DamageRect r = damage->rects[best];
+    damage->rects[best] = damage->rects[--damage->num_rects];
+    damage_add(damage, x0 < r.x0 ? x0 : r.x0, y0 < r.y0 ? y0 : r.y0, x1 > r.x1 ? x1 : r.x1, y1 > r.y1 ? y1 : r.y1);
+    return;
+  }
+
+  damage->rects[damage->num_rects++] = (DamageRect){x0, y0, x1, y1};
+}
+
+// Starts tracking damage on the root of [bmp]. Everything counts as damaged.
+bool bmp_track(Bitmap* bmp) {
+  Bitmap* root = bmp->root;
+  if (!root->damage) {
+    root->damage = (Damage*)calloc(1, sizeof(Damage));
+    if (!root->damage) {
+      return false;
+    }
+  }
+  damage_add(root->damage, 0, 0, root->w, root->h);
+  return true;
+}
+
+// Records that the already clipped area [x, y, w, h] of [bmp] was drawn to.
+void bmp_touch(Bitmap* bmp, int x, int y, int w, int h) {
+  Bitmap* root = bmp->root;
+  root->dirty = true;
+  if (root->damage) {
+    damage_add(root->damage, bmp->ox + x, bmp->oy + y, bmp->ox + x + w, bmp->oy + y + h);
+  }
+}
+
+// Fills [w] pixels at [td], only the color channels in KEEP_ALPHA.
+void span_fill(Color* td, int w, Color color, int mode) {
+  int c;
+  memcpy(&c, &color, sizeof(c));
+  __m128i vc = _mm_set1_epi32(c);
+
+  int x = 0;
+  if (mode == BLEND_ALPHA) {
+    for (; x + 4 <= w; x += 4) {
+      _mm_storeu_si128((__m128i*)&td[x], vc);
+    }
+    for (; x < w; x++) {
+      td[x] = color;
+    }
+    return;
+  }
+
+  __m128i keep = _mm_set1_epi32((int)0xff000000);
+  for (; x + 4 <= w; x += 4) {
+    __m128i d = _mm_loadu_si128((__m128i*)&td[x]);
+    _mm_storeu_si128((__m128i*)&td[x], _mm_or_si128(_mm_and_si128(d, keep), _mm_andnot_si128(keep, vc)));
+  }
+  for (; x < w; x++) {
+    td[x].r = color.r;
+    td[x].g = color.g;
+    td[x].b = color.b;
+  }
+}
+
+// A solid color in one of the color modes: its contribution and coverage are
+// constant, so it runs mode_sse2 as an opaque premultiplied source.
+ALWAYS_INLINE void span_mode_impl(Color* td, int w, Color color, int a, const int mode) {
+  int ca = a >> 8;
+  short pr = (short)(color.r * ca >> 8);
+  short pg = (short)(color.g * ca >> 8);
+  short pb = (short)(color.b * ca >> 8);
+  __m128i zero = _mm_setzero_si128();
+  __m128i vp = _mm_setr_epi16(pb, pg, pr, 0, pb, pg, pr, 0);
+  __m128i va = _mm_set1_epi16((short)ca);
+  __m128i cmask = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+
+  int x = 0;
+  for (; x + 4 <= w; x += 4) {
+    __m128i d = _mm_loadu_si128((__m128i*)&td[x]);
+    __m128i lo = mode_sse2(_mm_unpacklo_epi8(d, zero), vp, zero, zero, va, cmask, mode, TINT_NONE, true, true);
+    __m128i hi = mode_sse2(_mm_unpackhi_epi8(d, zero), vp, zero, zero, va, cmask, mode, TINT_NONE, true, true);
+    _mm_storeu_si128((__m128i*)&td[x], _mm_packus_epi16(lo, hi));
+  }
+  for (; x < w; x++) {
+    td[x].r = (unsigned char)blend_channel(td[x].r, pr, ca, mode);
+    td[x].g = (unsigned char)blend_channel(td[x].g, pg, ca, mode);
+    td[x].b = (unsigned char)blend_channel(td[x].b, pb, ca, mode);
+  }
+}
+
+void span_mode(Color* td, int w, Color color, int a, int mode) {
+  switch (mode) {
+    case BLEND_ADD:
+      span_mode_impl(td, w, color, a, BLEND_ADD);
+      break;
+    case BLEND_MULTIPLY:
+      span_mode_impl(td, w, color, a, BLEND_MULTIPLY);
+      break;
+    case BLEND_SCREEN:
+      span_mode_impl(td, w, color, a, BLEND_SCREEN);
+      break;
+    case BLEND_SUBTRACT:
+      span_mode_impl(td, w, color, a, BLEND_SUBTRACT);
+      break;
+  }
+}
+
+// Blends [color] into [w] pixels at [td] with the factor [a], bit-exact with bmp_plot.
+void span_blend(Color* td, int w, Color color, int a, int mode) {
+  if (a == 0) {
+    return;
+  }
+  if (mode > BLEND_ALPHA) {
+    span_mode(td, w, color, a, mode);
+    return;
+  }
+  if (a == 65536) {
+    span_fill(td, w, color, mode);
+    return;
+  }
+
+  int c;
+  memcpy(&c, &color, sizeof(c));
+  __m128i zero = _mm_setzero_si128();
+  __m128i vc = _mm_set1_epi32(c);
+  __m128i alo = _mm_set1_epi16((short)a);
+  __m128i afix = _mm_set1_epi16(a >= 32768 ? -1 : 0);
+  short am = mode == BLEND_ALPHA ? -1 : 0;
+  __m128i amask = _mm_setr_epi16(-1, -1, -1, am, -1, -1, -1, am);
+
+  int x = 0;
+  for (; x + 4 <= w; x += 4) {
+    __m128i d = _mm_loadu_si128((__m128i*)&td[x]);
+    _mm_storeu_si128((__m128i*)&td[x], blend4_sse2(d, vc, zero, zero, alo, afix, amask, TINT_NONE, true));
+  }
+  for (; x < w; x++) {
+    td[x].r += (unsigned char)((color.r - td[x].r) * a >> 16);
+    td[x].g += (unsigned char)((color.g - td[x].g) * a >> 16);
+    td[x].b += (unsigned char)((color.b - td[x].b) * a >> 16);
+    td[x].a += mode * (unsigned char)((color.a - td[x].a) * a >> 16);
+  }
+}
+
+// Starts a front-to-back pass on the root of [bmp], or ends it.
+bool bmp_cover(Bitmap* bmp, bool enabled) {
+  Bitmap* root = bmp->root;
+  size_t size = (size_t)(root->w + 63) / 64 * root->h * sizeof(uint64_t);
+  if (!enabled) {
+    free(root->coverage);
+    root->coverage = nullptr;
+  } else if (root->coverage) {
+    memset(root->coverage, 0, size);
+  } else {
+    root->coverage = (uint64_t*)calloc(1, size);
+  }
+  return !enabled || root->coverage;
+}
+
+ALWAYS_INLINE uint64_t* cover_row(Bitmap* bmp, int y) {
+  Bitmap* root = bmp->root;
+  return &root->coverage[(size_t)(bmp->oy + y) * ((root->w + 63) / 64)];
+}
+
+// The coverage of the [*n] pixels from [x] to the end of its word, at most [w].
+ALWAYS_INLINE uint64_t cover_chunk(const uint64_t* row, int x, int w, int* n, uint64_t* all) {
+  int b = x & 63;
+  *n = 64 - b < w ? 64 - b : w;
+  *all = *n == 64 ? ~0ull : (1ull << *n) - 1;
+  return row[x >> 6] >> b & *all;
+}
+
+// Pops the next run of set bits off [*m] into [*i, *i + *n).
+ALWAYS_INLINE bool cover_run(uint64_t* m, int* i, int* n) {
+  if (!*m) {
+    return false;
+  }
+  *i = __builtin_ctzll(*m);
+  *n = __builtin_ctzll(~(*m >> *i));
+  *m &= ~(((1ull << *n) - 1) << *i);
+  return true;
+}
+
+// Whether [m] has at most two runs: adding its lowest bit clears a run.
+ALWAYS_INLINE bool cover_few_runs(uint64_t m) {
+  m &= m + (m & -m);
+  m &= m + (m & -m);
+  return !m;
+}
+
+// The pixels of a chunk that a blit of [ts] with span [kind] covers.
+ALWAYS_INLINE uint64_t cover_bits(const Color* ts, int n, uint64_t all, int kind) {
+  if (kind != SPAN_BLEND) {
+    return kind == SPAN_OPAQUE ? all : 0;
+  }
+  uint64_t bits = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i a = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)&ts[i]), 24);
+    bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, _mm_set1_epi32(0xff)))) << i;
+  }
+  for (; i < n; i++) {
+    bits |= (uint64_t)(ts[i].a == 0xff) << i;
+  }
+  return bits;
+}
+
+// span_blend on the uncovered pixels of [td]; a full factor in BLEND_ALPHA covers them.
+void cover_blend(Bitmap* bmp, int x, int y, Color* td, int w, Color color, int a, int mode) {
+  if (!bmp->root->coverage) {
+    span_blend(td, w, color, a, mode);
+    return;
+  }
+
+  uint64_t* row = cover_row(bmp, y);
+  x += bmp->ox;
+  bool covers = a == 65536 && mode == BLEND_ALPHA;
+  int open = 0;
+  for (int i = 0, n; i < w; i += n) {
+    uint64_t all;
+    uint64_t covered = cover_chunk(row, x + i, w - i, &n, &all);
+    if (covered) {
+      if (open < i) {
+        span_blend(td + open, i - open, color, a, mode);
+      }
+      if (covered != all) {
+        uint64_t m = ~covered & all;
+        if (cover_few_runs(m)) {
+          for (int j, k; cover_run(&m, &j, &k);) {
+            span_blend(td + i + j, k, color, a, mode);
+          }
+        } else {
+          Color buf[64];
+          memcpy(buf, td + i, n * sizeof(Color));
+          span_blend(buf, n, color, a, mode);
+          for (; m; m &= m - 1) {
+            td[i + __builtin_ctzll(m)] = buf[__builtin_ctzll(m)];
+          }
+        }
+      }
+      open = i + n;
+    }
+    row[(x + i) >> 6] |= covers ? all << ((x + i) & 63) : 0;
+  }
+  if (open < w) {
+    span_blend(td + open, w - open, color, a, mode);
+  }
+}
+
+// Runs [fn] on the uncovered pixels, covering the ones [kind] replaces.
+void cover_blit(Bitmap* dst, int x, int y, Color* td, const Color* ts, int w, Color tint, BlitRowFn fn, int kind) {
+  if (!dst->root->coverage) {
+    fn(td, ts, w, tint);
+    return;
+  }
+
+  uint64_t* row = cover_row(dst, y);
+  x += dst->ox;
+  int open = 0;
+  for (int i = 0, n; i < w; i += n) {
+    uint64_t all;
+    uint64_t covered = cover_chunk(row, x + i, w - i, &n, &all);
+    if (covered) {
+      if (open < i) {
+        fn(td + open, ts + open, i - open, tint);
+      }
+      if (covered != all) {
+        uint64_t m = ~covered & all;
+        if (cover_few_runs(m)) {
+          for (int j, k; cover_run(&m, &j, &k);) {
+            fn(td + i + j, ts + i + j, k, tint);
+          }
+        } else {
+          Color buf[64];
+          memcpy(buf, td + i, n * sizeof(Color));
+          fn(buf, ts + i, n, tint);
+          for (; m; m &= m - 1) {
+            td[i + __builtin_ctzll(m)] = buf[__builtin_ctzll(m)];
+          }
+        }
+      }
+      open = i + n;
+    }
+    row[(x + i) >> 6] |= cover_bits(ts + i, n, all, kind) << ((x + i) & 63);
+  }
+  if (open < w) {
+    fn(td + open, ts + open, w - open, tint);
+  }
+}
+
+// Whether opaque source pixels blitted with [tint] replace the destination.
+bool blit_covers(Bitmap* dst, Color tint) {
+  return dst->blit_mode == BLEND_ALPHA && tint.a == 0xff;
+}
+
+// TILED BITMAPS
+
+// Pixel [x, y] of a bitmap whose root keeps its pixels in blocks.
+ALWAYS_INLINE Color* block_at(Bitmap* bmp, int x, int y) {
+  Bitmap* root = bmp->root;
+  x += bmp->ox;
+  y += bmp->oy;
+  return &root->blocks[((size_t)(y >> 3) * ((root->w + 7) >> 3) + (x >> 3)) * 64 + (y & 7) * 8 + (x & 7)];
+}
+
+// Blends the area [x0, y0, x1, y1) of a bitmap in blocks a block column at a
+// time, stepping down each column by pointer.
+void blocks_area(Bitmap* bmp, int x0, int y0, int x1, int y1, Color color, int a, int mode) {
+  size_t pitch = (size_t)((bmp->root->w + 7) >> 3) * 64;
+  for (int x = x0, n; x < x1; x += n) {
+    n = 8 - ((bmp->ox + x) & 7) < x1 - x ? 8 - ((bmp->ox + x) & 7) : x1 - x;
+    Color* td = block_at(bmp, x, y0);
+    for (int y = y0; y < y1; y++) {
+      cover_blend(bmp, x, y, td, n, color, a, mode);
+      td += ((bmp->oy + y) & 7) == 7 ? pitch - 56 : 8;
+    }
+  }
+}
+
+// Copies [w] pixels of row [y] of a bitmap in blocks, from [x] on, into
+// [buf], and back.
+void blocks_load(Bitmap* bmp, int x, int y, int w, Color* buf) {
+  for (int n; w > 0; x += n, buf += n, w -= n) {
+    n = 8 - ((bmp->ox + x) & 7) < w ? 8 - ((bmp->ox + x) & 7) : w;
+    memcpy(buf, block_at(bmp, x, y), n * sizeof(Color));
+  }
+}
+
+void blocks_store(Bitmap* bmp, int x, int y, int w, const Color* buf) {
+  for (int n; w > 0; x += n, buf += n, w -= n) {
+    n = 8 - ((bmp->ox + x) & 7) < w ? 8 - ((bmp->ox + x) & 7) : w;
+    memcpy(block_at(bmp, x, y), buf, n * sizeof(Color));
+  }
+}
+
+// The whole blocks of a block row are contiguous, and without a coverage mask
+// they blend in one go. The bands and strips around them walk columns.
+void blend_area_blocks(Bitmap* bmp, int x0, int y0, int x1, int y1, Color color, int a, int mode) {
+  int ox = bmp->ox;
+  int oy = bmp->oy;
+  int bx0 = ((ox + x0 + 7) & ~7) - ox;
+  int bx1 = ((ox + x1) & ~7) - ox;
+  int by0 = ((oy + y0 + 7) & ~7) - oy;
+  int by1 = ((oy + y1) & ~7) - oy;
+  if (bmp->root->coverage || bx0 >= bx1 || by0 >= by1) {
+    blocks_area(bmp, x0, y0, x1, y1, color, a, mode);
+    return;
+  }
+
+  for (int y = by0; y < by1; y += 8) {
+    span_blend(block_at(bmp, bx0, y), (bx1 - bx0) * 8, color, a, mode);
+  }
+  blocks_area(bmp, x0, y0, x1, by0, color, a, mode);
+  blocks_area(bmp, x0, by1, x1, y1, color, a, mode);
+  blocks_area(bmp, x0, by0, bx0, by1, color, a, mode);
+  blocks_area(bmp, bx1, by0, x1, by1, color, a, mode);
+}
+
+// Kernels run on each block segment of the row in place. A null [fn]
+// copies, storing the source straight in when nothing is covered.
+void blit_at_blocks(Bitmap* dst, int x, int y, const Color* ts, int w, Color tint, BlitRowFn fn, int kind) {
+  if (!fn && !dst->root->coverage) {
+    blocks_store(dst, x, y, w, ts);
+    return;
+  }
+
+  fn = fn ? fn : blit_kernels[true][TINT_NONE][BLEND_ALPHA];
+  for (int i = 0, n; i < w; i += n) {
+    n = 8 - ((dst->ox + x + i) & 7) < w - i ? 8 - ((dst->ox + x + i) & 7) : w - i;
+    cover_blit(dst, x + i, y, block_at(dst, x + i, y), ts + i, n, tint, fn, kind);
+  }
+}
+
+// Stages the area [x0, y0, x1, y1) of a bitmap in blocks in data, and stores
+// it back.
+void bmp_deswizzle(Bitmap* bmp, int x0, int y0, int x1, int y1) {
+  for (int y = y0; y < y1; y++) {
+    blocks_load(bmp, x0, y, x1 - x0, &bmp->data[y * bmp->stride + x0]);
+  }
+}
+
+void bmp_swizzle(Bitmap* bmp, int x0, int y0, int x1, int y1) {
+  for (int y = y0; y < y1; y++) {
+    blocks_store(bmp, x0, y, x1 - x0, &bmp->data[y * bmp->stride + x0]);
+  }
+}
+
+// Moves the pixels of a root between data and blocks. Returns false when the
+// blocks cannot be allocated.
+bool bmp_use_blocks(Bitmap* bmp, bool enabled) {
+  bmp = bmp->root;
+  if (enabled == (bmp->blocks != nullptr)) {
+    return true;
+  }
+
+  if (enabled) {
+    bmp->blocks = (Color*)malloc((size_t)((bmp->w + 7) >> 3) * ((bmp->h + 7) >> 3) * 64 * sizeof(Color));
+    if (!bmp->blocks) {
+      return false;
+    }
+    bmp_swizzle(bmp, 0, 0, bmp->w, bmp->h);
+  } else {
+    bmp_deswizzle(bmp, 0, 0, bmp->w, bmp->h);
+    free(bmp->blocks);
+    bmp->blocks = nullptr;
+  }
+
+  if (bmp->damage) {
+    damage_add(bmp->damage, 0, 0, bmp->w, bmp->h);
+  }
+  return true;
+}
+
+// BITMAP LAYOUTS
+
+// How a root keeps its pixels; expand and pack stage an area in data when they are set.
+typedef struct {
+  void (*blend_area)(Bitmap* bmp, int x0, int y0, int x1, int y1, Color color, int a, int mode);
+  void (*blit_at)(Bitmap* dst, int x, int y, const Color* ts, int w, Color tint, BlitRowFn fn, int kind);
+  void (*expand)(Bitmap* bmp, int x0, int y0, int x1, int y1);
+  void (*pack)(Bitmap* bmp, int x0, int y0, int x1, int y1);
+} Layout;
+
+void blend_area_plain(Bitmap* bmp, int x0, int y0, int x1, int y1, Color color, int a, int mode) {
+  for (int y = y0; y < y1; y++) {
+    cover_blend(bmp, x0, y, &bmp->data[y * bmp->stride + x0], x1 - x0, color, a, mode);
+  }
+}
+
+void blit_at_plain(Bitmap* dst, int x, int y, const Color* ts, int w, Color tint, BlitRowFn fn, int kind) {
+  Color* td = &dst->data[y * dst->stride + x];
+  if (!fn && !dst->root->coverage) {
+    memcpy(td, ts, w * sizeof(Color));
+    return;
+  }
+  cover_blit(dst, x, y, td, ts, w, tint, fn ? fn : blit_kernels[true][TINT_NONE][BLEND_ALPHA], kind);
+}
+
+Layout layout_plain = {blend_area_plain, blit_at_plain, nullptr, nullptr};
+Layout layout_blocks = {blend_area_blocks, blit_at_blocks, bmp_deswizzle, bmp_swizzle};
+
+Layout* bmp_layout(Bitmap* bmp) {
+  return bmp->blocks ? &layout_blocks : &layout_plain;
+}
+
+// Copies an area inside the bitmap to and from packed RGBA [bytes], pixels as stored.
+void bmp_read(Bitmap* bmp, int x, int y, int w, int h, unsigned char* bytes) {
+  Bitmap* root = bmp->root;
+  Layout* layout = bmp_layout(root);
+  if (layout->expand) {
+    layout->expand(root, bmp->ox + x, bmp->oy + y, bmp->ox + x + w, bmp->oy + y + h);
+  }
+
+  for (int j = 0; j < h; j++) {
+    Color* row = &bmp->data[(y + j) * bmp->stride + x];
+    for (int i = 0; i < w; i++, bytes += 4) {
+      bytes[0] = row[i].r;
+      bytes[1] = row[i].g;
+      bytes[2] = row[i].b;
+      bytes[3] = row[i].a;
+    }
+  }
+}
+
+void bmp_write(Bitmap* bmp, int x, int y, int w, int h, const unsigned char* bytes) {
+  for (int j = 0; j < h; j++) {
+    Color* row = &bmp->data[(y + j) * bmp->stride + x];
+    for (int i = 0; i < w; i++, bytes += 4) {
+      row[i] = new_color(bytes[0], bytes[1], bytes[2], bytes[3]);
+    }
+  }
+
+  Bitmap* root = bmp->root;
+  Layout* layout = bmp_layout(root);
+  if (layout->expand) {
+    layout->pack(root, bmp->ox + x, bmp->oy + y, bmp->ox + x + w, bmp->oy + y + h);
+  }
+  if (w > 0 && h > 0) {
+    bmp_touch(bmp, x, y, w, h);
+  }
+}
+
+// DRAWING
+
+// Clears the clip rectangle, or the whole bitmap when there is none.
+void bmp_clear(Bitmap* bmp, Color color) {
+  int x0 = bmp->cx > 0 ? bmp->cx : 0;
+  int y0 = bmp->cy > 0 ? bmp->cy : 0;
+  int x1 = bmp->cw >= 0 && bmp->cx + bmp->cw < bmp->w ? bmp->cx + bmp->cw : bmp->w;
+  int y1 = bmp->ch >= 0 && bmp->cy + bmp->ch < bmp->h ? bmp->cy + bmp->ch : bmp->h;
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+
+  bmp_touch(bmp, x0, y0, x1 - x0, y1 - y0);
+  bmp_layout(bmp)->blend_area(bmp, x0, y0, x1, y1, color, 65536, BLEND_ALPHA);
+}
+
+Color bmp_get(Bitmap* bmp, int x, int y) {
+  Color empty = {0, 0, 0, 0};
+  if (x >= 0 && y >= 0 && x < bmp->w && y < bmp->h)
+    return bmp->data[y * bmp->stride + x];
+  return empty;
+}
+
+void bmp_plot(Bitmap* bmp, int x, int y, Color color) {
+  int xa, a;
+
+  int cx = bmp->cx;
+  int cy = bmp->cy;
+  int cw = bmp->cw >= 0 ? bmp->cw : bmp->w;
+  int ch = bmp->ch >= 0 ? bmp->ch : bmp->h;
+
+  if (x >= cx && y >= cy && x < cx + cw && y < cy + ch) {
+    xa = EXPAND(color.a);
+    a = xa * xa;
+    bmp_touch(bmp, x, y, 1, 1);
+    bmp_layout(bmp)->blend_area(bmp, x, y, x + 1, y + 1, color, a, bmp->blit_mode);
+  }
+}
+
+long long floor_div(long long a, long long b) {
+  return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+// Bresenham up to (x1, y1) exclusive, with the clipped range solved before the loop.
+void bmp_line(Bitmap* bmp, int x0, int y0, int x1, int y1, Color color) {
+  int cx0 = bmp->cx;
+  int cy0 = bmp->cy;
+  int cx1 = cx0 + (bmp->cw >= 0 ? bmp->cw : bmp->w);
+  int cy1 = cy0 + (bmp->ch >= 0 ? bmp->ch : bmp->h);
+
+  int dx = abs(x1 - x0);
+  int dy = abs(y1 - y0);
+  int sx = x0 < x1 ? 1 : -1;
+  int sy = y0 < y1 ? 1 : -1;
+  int xa = EXPAND(color.a);
+  int a = xa * xa;
+
+  if (dx == 0 && dy == 0) {
+    bmp_plot(bmp, x0, y0, color);
+    return;
+  }
+
+  // Horizontal and vertical lines are spans.
+  if (dy == 0 || dx == 0) {
+    int lx0 = sx > 0 || dx == 0 ? x0 : x1 + 1;
+    int ly0 = sy > 0 || dy == 0 ? y0 : y1 + 1;
+    int lx1 = lx0 + (dx > 0 ? dx : 1);
+    int ly1 = ly0 + (dy > 0 ? dy : 1);
+    lx0 = lx0 > cx0 ? lx0 : cx0;
+    ly0 = ly0 > cy0 ? ly0 : cy0;
+    lx1 = lx1 < cx1 ? lx1 : cx1;
+    ly1 = ly1 < cy1 ? ly1 : cy1;
+    if (lx0 >= lx1 || ly0 >= ly1) {
+      return;
+    }
+
+    bmp_touch(bmp, lx0, ly0, lx1 - lx0, ly1 - ly0);
+    bmp_layout(bmp)->blend_area(bmp, lx0, ly0, lx1, ly1, color, a, bmp->blit_mode);
+    return;
+  }
+
+  // Walk along the major axis (u) and step the minor axis (v).
+  bool steep = dy > dx;
+  int major = steep ? dy : dx;
+  int minor = steep ? dx : dy;
+  int u0 = steep ? y0 : x0;
+  int v0 = steep ? x0 : y0;
+  int su = steep ? sy : sx;
+  int sv = steep ? sx : sy;
+  int cu0 = steep ? cy0 : cx0;
+  int cu1 = steep ? cy1 : cx1;
+  int cv0 = steep ? cx0 : cy0;
+  int cv1 = steep ? cx1 : cy1;
+
+  // Steps whose major coordinate is inside the clip.
+  long long i0 = su > 0 ? cu0 - u0 : u0 - (cu1 - 1);
+  long long i1 = su > 0 ? cu1 - 1 - u0 : u0 - cu0;
+  // Minor offsets inside the clip, turned into steps.
+  long long k0 = sv > 0 ? cv0 - v0 : v0 - (cv1 - 1);
+  long long k1 = sv > 0 ? cv1 - 1 - v0 : v0 - cv0;
+  long long j0 = floor_div(2LL * major * k0 - major + 1 + 2LL * minor - 1, 2LL * minor);
+  long long j1 = floor_div(2LL * major * (k1 + 1) - major, 2LL * minor);
+  i0 = i0 > j0 ? i0 : j0;
+  i1 = i1 < j1 ? i1 : j1;
+  i0 = i0 > 0 ? i0 : 0;
+  i1 = i1 < major - 1 ? i1 : major - 1;
+  if (i0 > i1) {
+    return;
+  }
+
+  long long num = 2LL * i0 * minor + major - 1;
+  int v = v0 + sv * (int)floor_div(num, 2LL * major);
+  int rem = (int)(num - floor_div(num, 2LL * major) * 2 * major);
+  int u = u0 + su * (int)i0;
+  int n = (int)(i1 - i0) + 1;
+
+  int ue = u + su * (n - 1);
+  int ve = v0 + sv * (int)floor_div(2LL * i1 * minor + major - 1, 2LL * major);
+  int bu0 = u < ue ? u : ue;
+  int bv0 = v < ve ? v : ve;
+  int bu = abs(ue - u) + 1;
+  int bv = abs(ve - v) + 1;
+  if (steep) {
+    bmp_touch(bmp, bv0, bu0, bv, bu);
+  } else {
+    bmp_touch(bmp, bu0, bv0, bu, bv);
+  }
+
+  // Blocks and the coverage mask step coordinates instead of a pointer.
+  if (bmp->blocks || bmp->root->coverage) {
+    int x = steep ? v : u;
+    int y = steep ? u : v;
+    do {
+      Color* td = bmp->blocks ? block_at(bmp, x, y) : &bmp->data[y * bmp->stride + x];
+      cover_blend(bmp, x, y, td, 1, color, a, bmp->blit_mode);
+      x += steep ? 0 : su;
+      y += steep ? su : 0;
+      rem += 2 * minor;
+      if (rem >= 2 * major) {
+        rem -= 2 * major;
+        x += steep ? sv : 0;
+        y += steep ? 0 : sv;
+      }
+    } while (--n);
+    return;
+  }
+
+  int stride = bmp->stride;
+  int du = steep ? su * stride : su;
+  int dv = steep ? sv : sv * stride;
+  Color* td = steep ? &bmp->data[u * stride + v] : &bmp->data[v * stride + u];
+  do {
+    span_blend(td, 1, color, a, bmp->blit_mode);
+    td += du;
+    rem += 2 * minor;
+    if (rem >= 2 * major) {
+      rem -= 2 * major;
+      td += dv;
+    }
+  } while (--n);
+}
+
+void bmp_rect(Bitmap* bmp, int x, int y, int w, int h, Color color) {
+  x += 1;
+  y += 1;
+  w -= 2;
+  h -= 2;
+
+  int cx = bmp->cx;
+  int cy = bmp->cy;
+  int cw = bmp->cw >= 0 ? bmp->cw : bmp->w;
+  int ch = bmp->ch >= 0 ? bmp->ch : bmp->h;
+
+  if (x < cx) {
+    w += (x - cx);
+    x = cx;
+  }
+  if (y < cy) {
+    h += (y - cy);
+    y = cy;
+  }
+  if (x + w > cx + cw) {
+    w -= (x + w) - (cx + cw);
+  }
+  if (y + h > cy + ch) {
+    h -= (y + h) - (cy + ch);
+  }
+  if (w <= 0 || h <= 0)
+    return;
+
+  bmp_touch(bmp, x, y, w, h);
+  int xa = EXPAND(color.a);
+  bmp_layout(bmp)->blend_area(bmp, x, y, x + w, y + h, color, xa * xa, bmp->blit_mode);
+}
+
+void bmp_rect_line(Bitmap* bmp, int x, int y, int w, int h, Color color) {
+  int x1, y1;
+  if (w <= 0 || h <= 0) {
+    return;
+  }
+
+  if (w == 1) {
+    bmp_line(bmp, x, y, x, y + h, color);
+  } else if (h == 1) {
+    bmp_line(bmp, x, y, x + w, y, color);
+  } else {
+    x1 = x + w - 1;
+    y1 = y + h - 1;
+    bmp_line(bmp, x, y, x1, y, color);
+    bmp_line(bmp, x1, y, x1, y1, color);
+    bmp_line(bmp, x1, y1, x, y1, color);
+    bmp_line(bmp, x, y1, x, y, color);
+  }
+}
+
+// The kernels for opaque and blended spans; transparent spans are skipped.
+typedef struct {
+  BlitRowFn opaque;
+  BlitRowFn blend;
+} BlitKernel;
+
+// Straight sources keep the original kernels whatever the destination holds:
+// their color math is already "over" for premultiplied destinations too.
+BlitKernel blit_select(Bitmap* dst, bool premultiplied, Color tint) {
+  BlitRowFn (*kernels)[3][NUM_BLIT_MODES] = premultiplied ? blit_kernels_pm : blit_kernels;
+  int kind = tint_kind(tint);
+  return (BlitKernel){kernels[true][kind][dst->blit_mode], kernels[false][kind][dst->blit_mode]};
+}
+
+void bmp_blit_kernel(Bitmap* dst, Bitmap* src, int dx, int dy, int sx, int sy, int w, int h, Color tint,
+                     BlitKernel kernel) {
+  int cw = dst->cw >= 0 ? dst->cw : dst->w;
+  int ch = dst->ch >= 0 ? dst->ch : dst->h;
+
+  CLIP();
+
+  Bitmap* root = src->root;
+  if (root->dirty) {
+    bmp_classify(root);
+  }
+  bmp_touch(dst, dx, dy, w, h);
+
+  Layout* layout = bmp_layout(dst);
+  Color* ts = &src->data[sy * src->stride + sx];
+  int st = src->stride;
+  bool covers = blit_covers(dst, tint);
+
+  if (root->alpha_class == ALPHA_OPAQUE || !root->spans) {
+    bool opaque = root->alpha_class == ALPHA_OPAQUE;
+    int kind = opaque ? SPAN_OPAQUE : SPAN_BLEND;
+    do {
+      layout->blit_at(dst, dx, dy++, ts, w, tint, opaque ? kernel.opaque : kernel.blend, covers ? kind : SPAN_SKIP);
+      ts += st;
+    } while (--h);
+    return;
+  }
+
+  sx += src->ox;
+  sy += src->oy;
+  int sx1 = sx + w;
+  int bw = (root->w + SPAN_SIZE - 1) / SPAN_SIZE;
+  for (int y = sy; y < sy + h; y++) {
+    unsigned char* spans = &root->spans[y * bw];
+    int x0 = sx;
+    while (x0 < sx1) {
+      int kind = spans[x0 / SPAN_SIZE];
+      int x1 = (x0 / SPAN_SIZE + 1) * SPAN_SIZE;
+      while (x1 < sx1 && spans[x1 / SPAN_SIZE] == kind) {
+        x1 += SPAN_SIZE;
+      }
+      if (x1 > sx1) {
+        x1 = sx1;
+      }
+      if (kind != SPAN_SKIP) {
+        BlitRowFn fn = kind == SPAN_OPAQUE ? kernel.opaque : kernel.blend;
+        layout->blit_at(dst, dx + (x0 - sx), dy + (y - sy), ts + (x0 - sx), x1 - x0, tint, fn,
+                        covers ? kind : SPAN_SKIP);
+      }
+      x0 = x1;
+    }
+    ts += st;
+  }
+}
+
+void bmp_blit_tint(Bitmap* dst, Bitmap* src, int dx, int dy, int sx, int sy, int w, int h, Color tint) {
+  if (tint.a == 0) {
+    return;
+  }
+  bmp_blit_kernel(dst, src, dx, dy, sx, sy, w, h, tint, blit_select(dst, src->premultiplied, tint));
+}
+
+// Copies pixels as they are, except in the color modes, which blend.
+void bmp_blit(Bitmap* dst, Bitmap* src, int dx, int dy, int sx, int sy, int w, int h) {
+  if (dst->blit_mode > BLEND_ALPHA) {
+    bmp_blit_tint(dst, src, dx, dy, sx, sy, w, h, (Color){0xff, 0xff, 0xff, 0xff});
+    return;
+  }
+
+  int cw = dst->cw >= 0 ? dst->cw : dst->w;
+  int ch = dst->ch >= 0 ? dst->ch : dst->h;
+
+  CLIP();
+
+  // A copy replaces every pixel, transparent ones included.
+  bmp_touch(dst, dx, dy, w, h);
+  Layout* layout = bmp_layout(dst);
+  Color* ts = &src->data[sy * src->stride + sx];
+  do {
+    layout->blit_at(dst, dx, dy++, ts, w, (Color){0xff, 0xff, 0xff, 0xff}, nullptr, SPAN_OPAQUE);
+    ts += src->stride;
+  } while (--h);
+}
+
+void bmp_blit_alpha(Bitmap* dst, Bitmap* src, int dx, int dy, int sx, int sy, int w, int h, float alpha) {
+  alpha = (alpha < 0) ? 0 : (alpha > 1 ? 1 : alpha);
+  bmp_blit_tint(dst, src, dx, dy, sx, sy, w, h, new_color(0xff, 0xff, 0xff, (unsigned char)(alpha * 255)));
+}
+
+// TRANSFORMED BLITS
+
+// Scales, then rotates by [angle] radians around source point ([ox], [oy]), placed at ([x], [y]).
+typedef struct {
+  float x, y;
+  float angle;
+  float scale_x, scale_y;
+  float ox, oy;
+} Transform;
+
+// A bounding box of the pixels a transformed blit may touch.
+void transform_bounds(Transform* tf, int w, int h, int* x0, int* y0, int* x1, int* y1) {
+  float c = cosf(tf->angle);
+  float s = sinf(tf->angle);
+  float min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY;
+  for (int i = 0; i < 4; i++) {
+    float px = ((i & 1 ? w : 0) - tf->ox) * tf->scale_x;
+    float py = ((i & 2 ? h : 0) - tf->oy) * tf->scale_y;
+    float qx = tf->x + c * px - s * py;
+    float qy = tf->y + s * px + c * py;
+    min_x = qx < min_x ? qx : min_x;
+    min_y = qy < min_y ? qy : min_y;
+    max_x = qx > max_x ? qx : max_x;
+    max_y = qy > max_y ? qy : max_y;
+  }
+  *x0 = (int)fmaxf(floorf(min_x) - 1, -1e9f);
+  *y0 = (int)fmaxf(floorf(min_y) - 1, -1e9f);
+  *x1 = (int)fminf(ceilf(max_x) + 1, 1e9f);
+  *y1 = (int)fminf(ceilf(max_y) + 1, 1e9f);
+}
+
+// Narrows the steps [*i0, *i1) to those where u0 + i * du stays in [lo, hi).
+void transform_span(long long u0, long long du, long long lo, long long hi, int* i0, int* i1) {
+  long long a, b;
+  if (du == 0) {
+    if (u0 < lo || u0 >= hi) {
+      *i1 = *i0;
+    }
+    return;
+  }
+  if (du > 0) {
+    a = -floor_div(u0 - lo, du);
+    b = floor_div(hi - 1 - u0, du) + 1;
+  } else {
+    a = -floor_div(hi - 1 - u0, -du);
+    b = floor_div(u0 - lo, -du) + 1;
+  }
+  *i0 = a > *i0 ? (int)(a < *i1 ? a : *i1) : *i0;
+  *i1 = b < *i1 ? (int)(b > *i0 ? b : *i0) : *i1;
+}
+
+// Nearest-neighbour sampling in 16.16 fixed point, blended by the bmp_blit_tint kernels.
+void bmp_blit_ex(Bitmap* dst, Bitmap* src, int sx, int sy, int w, int h, Transform* tf, Color tint) {
+  if (tint.a == 0 || tf->scale_x == 0 || tf->scale_y == 0) {
+    return;
+  }
+
+  int x0, y0, x1, y1;
+  transform_bounds(tf, w, h, &x0, &y0, &x1, &y1);
+
+  int cx0 = dst->cx;
+  int cy0 = dst->cy;
+  int cx1 = cx0 + (dst->cw >= 0 ? dst->cw : dst->w);
+  int cy1 = cy0 + (dst->ch >= 0 ? dst->ch : dst->h);
+  x0 = x0 > cx0 ? x0 : cx0;
+  y0 = y0 > cy0 ? y0 : cy0;
+  x1 = x1 < cx1 ? x1 : cx1;
+  y1 = y1 < cy1 ? y1 : cy1;
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+
+  // Source pixels outside the bitmap are never sampled.
+  long long lo_u = (long long)(sx < 0 ? -sx : 0) * 65536;
+  long long lo_v = (long long)(sy < 0 ? -sy : 0) * 65536;
+  long long hi_u = (long long)(sx + w < src->w ? w : src->w - sx) * 65536;
+  long long hi_v = (long long)(sy + h < src->h ? h : src->h - sy) * 65536;
+  if (lo_u >= hi_u || lo_v >= hi_v) {
+    return;
+  }
+
+  Bitmap* root = src->root;
+  if (root->dirty) {
+    bmp_classify(root);
+  }
+  bmp_touch(dst, x0, y0, x1 - x0, y1 - y0);
+
+  BlitKernel kernel = blit_select(dst, src->premultiplied, tint);
+  bool opaque = root->alpha_class == ALPHA_OPAQUE;
+  BlitRowFn fn = opaque ? kernel.opaque : kernel.blend;
+  int kind = !blit_covers(dst, tint) ? SPAN_SKIP : opaque ? SPAN_OPAQUE : SPAN_BLEND;
+  Layout* layout = bmp_layout(dst);
+
+  double c = cos(tf->angle);
+  double s = sin(tf->angle);
+  double ux = c / tf->scale_x, uy = s / tf->scale_x;
+  double vx = -s / tf->scale_y, vy = c / tf->scale_y;
+  long long du = llround(ux * 65536.0);
+  long long dv = llround(vx * 65536.0);
+  long long duy = llround(uy * 65536.0);
+  long long dvy = llround(vy * 65536.0);
+  // Every pixel steps from the sample point of (0, 0), so clips and tiles agree.
+  long long u00 = llround((tf->ox + ux * (0.5 - tf->x) + uy * (0.5 - tf->y)) * 65536.0);
+  long long v00 = llround((tf->oy + vx * (0.5 - tf->x) + vy * (0.5 - tf->y)) * 65536.0);
+  Color buf[256];
+
+  for (int y = y0; y < y1; y++) {
+    long long u0 = u00 + y * duy + x0 * du;
+    long long v0 = v00 + y * dvy + x0 * dv;
+
+    int i0 = 0, i1 = x1 - x0;
+    transform_span(u0, du, lo_u, hi_u, &i0, &i1);
+    transform_span(v0, dv, lo_v, hi_v, &i0, &i1);
+
+    int u = (int)(u0 + i0 * du);
+    int v = (int)(v0 + i0 * dv);
+    int idu = (int)du, idv = (int)dv;
+    while (i0 < i1) {
+      int n = i1 - i0 < 256 ? i1 - i0 : 256;
+      for (int i = 0; i < n; i++) {
+        buf[i] = src->data[(sy + (v >> 16)) * src->stride + sx + (u >> 16)];
+        u += idu;
+        v += idv;
+      }
+      layout->blit_at(dst, x0 + i0, y, buf, n, tint, fn, kind);
+      i0 += n;
+    }
+  }
+}
+
+// Flips mirror the destination after ROTATE_90 turns the source clockwise.
+enum {
+  FLIP_X = 1,
+  FLIP_Y = 2,
+  ROTATE_90 = 4,
+};
+
+#define FLIP_BLOCK 32
+
+// Blits in the orientation [flip]; rotations transpose FLIP_BLOCK-square blocks in cache.
+void bmp_blit_oriented(Bitmap* dst, Bitmap* src, int dx, int dy, int sx, int sy, int w, int h, int flip,
+                       const BlitKernel* kernel, Color tint) {
+  bool rot = flip & ROTATE_90;
+
+  // Trim the source region to the bitmap, in destination order before the flips.
+  int sl = sx < 0 ? -sx : 0;
+  int st = sy < 0 ? -sy : 0;
+  int sr = sx + w > src->w ? sx + w - src->w : 0;
+  int sb = sy + h > src->h ? sy + h - src->h : 0;
+  sx += sl;
+  sy += st;
+  w -= sl + sr;
+  h -= st + sb;
+  if (w <= 0 || h <= 0) {
+    return;
+  }
+  int il = rot ? sb : sl, ir = rot ? st : sr;
+  int jt = rot ? sl : st, jb = rot ? sr : sb;
+  dx += flip & FLIP_X ? ir : il;
+  dy += flip & FLIP_Y ? jb : jt;
+  int dw = rot ? h : w;
+  int dh = rot ? w : h;
+
+  int x0 = dx > dst->cx ? dx : dst->cx;
+  int y0 = dy > dst->cy ? dy : dst->cy;
+  int x1 = dst->cx + (dst->cw >= 0 ? dst->cw : dst->w);
+  int y1 = dst->cy + (dst->ch >= 0 ? dst->ch : dst->h);
+  x1 = dx + dw < x1 ? dx + dw : x1;
+  y1 = dy + dh < y1 ? dy + dh : y1;
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+
+  // A copy replaces every pixel, transparent ones included.
+  BlitRowFn fn = nullptr;
+  int kind = SPAN_OPAQUE;
+  if (kernel) {
+    Bitmap* root = src->root;
+    if (root->dirty) {
+      bmp_classify(root);
+    }
+    bool opaque = root->alpha_class == ALPHA_OPAQUE;
+    fn = opaque ? kernel->opaque : kernel->blend;
+    kind = !blit_covers(dst, tint) ? SPAN_SKIP : opaque ? SPAN_OPAQUE : SPAN_BLEND;
+  }
+  bmp_touch(dst, x0, y0, x1 - x0, y1 - y0);
+  Layout* layout = bmp_layout(dst);
+
+  // Destination (dx + i, dy + j) reads source (u0 + i * ui + j * uj, v0 + i * vi + j * vj).
+  int fi = flip & FLIP_X ? -1 : 1;
+  int fj = flip & FLIP_Y ? -1 : 1;
+  int i0 = flip & FLIP_X ? dw - 1 : 0;
+  int j0 = flip & FLIP_Y ? dh - 1 : 0;
+  int u0 = rot ? sx + j0 : sx + i0;
+  int v0 = rot ? sy + h - 1 - i0 : sy + j0;
+  int ui = rot ? 0 : fi;
+  int uj = rot ? fj : 0;
+  int vi = rot ? -fi : 0;
+  int vj = rot ? 0 : fj;
+
+  Color buf[FLIP_BLOCK * FLIP_BLOCK];
+  if (!rot) {
+    for (int y = y0; y < y1; y++) {
+      const Color* ts = &src->data[(v0 + (y - dy) * vj) * src->stride + u0 + (x0 - dx) * ui];
+      for (int x = x0; x < x1; x += FLIP_BLOCK * FLIP_BLOCK) {
+        int n = x1 - x < FLIP_BLOCK * FLIP_BLOCK ? x1 - x : FLIP_BLOCK * FLIP_BLOCK;
+        const Color* row = ts;
+        if (ui < 0) {
+          int i = 0;
+          for (; i + 4 <= n; i += 4) {
+            __m128i p = _mm_loadu_si128((const __m128i*)&ts[-i - 3]);
+            _mm_storeu_si128((__m128i*)&buf[i], _mm_shuffle_epi32(p, 0x1b));
+          }
+          for (; i < n; i++) {
+            buf[i] = ts[-i];
+          }
+          row = buf;
+        }
+        layout->blit_at(dst, x, y, row, n, tint, fn, kind);
+        ts += n * ui;
+      }
+    }
+    return;
+  }
+
+  for (int by = y0; by < y1; by += FLIP_BLOCK) {
+    int bh = y1 - by < FLIP_BLOCK ? y1 - by : FLIP_BLOCK;
+    for (int bx = x0; bx < x1; bx += FLIP_BLOCK) {
+      int bw = x1 - bx < FLIP_BLOCK ? x1 - bx : FLIP_BLOCK;
+      int i = bx - dx;
+      int j = by - dy;
+      int u = u0 + i * ui + j * uj;
+      int v = v0 + i * vi + j * vj;
+
+      // Four source rows become four destination columns, transposed in registers.
+      int x = 0;
+      for (; x + 4 <= bw; x += 4) {
+        const Color* ts[4];
+        for (int k = 0; k < 4; k++) {
+          ts[k] = &src->data[(v + (x + k) * vi) * src->stride + u];
+        }
+        int y = 0;
+        for (; y + 4 <= bh; y += 4) {
+          __m128i r[4];
+          for (int k = 0; k < 4; k++) {
+            if (uj > 0) {
+              r[k] = _mm_loadu_si128((const __m128i*)&ts[k][y]);
+            } else {
+              r[k] = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&ts[k][-y - 3]), 0x1b);
+            }
+          }
+          __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+          __m128i t1 = _mm_unpacklo_epi32(r[2], r[3]);
+          __m128i t2 = _mm_unpackhi_epi32(r[0], r[1]);
+          __m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+          _mm_storeu_si128((__m128i*)&buf[y * FLIP_BLOCK + x], _mm_unpacklo_epi64(t0, t1));
+          _mm_storeu_si128((__m128i*)&buf[(y + 1) * FLIP_BLOCK + x], _mm_unpackhi_epi64(t0, t1));
+          _mm_storeu_si128((__m128i*)&buf[(y + 2) * FLIP_BLOCK + x], _mm_unpacklo_epi64(t2, t3));
+          _mm_storeu_si128((__m128i*)&buf[(y + 3) * FLIP_BLOCK + x], _mm_unpackhi_epi64(t2, t3));
+        }
+        for (; y < bh; y++) {
+          for (int k = 0; k < 4; k++) {
+            buf[y * FLIP_BLOCK + x + k] = ts[k][y * uj];
+          }
+        }
+      }
+      for (; x < bw; x++) {
+        const Color* ts = &src->data[(v + x * vi) * src->stride + u];
+        for (int y = 0; y < bh; y++) {
+          buf[y * FLIP_BLOCK + x] = ts[y * uj];
+        }
+      }
+
+      for (int y = 0; y < bh; y++) {
+        layout->blit_at(dst, bx, by + y, &buf[y * FLIP_BLOCK], bw, tint, fn, kind);
+      }
+    }
+  }
+}
+
+void bmp_blit_flip_tint(Bitmap* dst, Bitmap* src, int dx, int dy, int sx, int sy, int w, int h, int flip,
+                        Color tint) {
+  if (flip == 0) {
+    bmp_blit_tint(dst, src, dx, dy, sx, sy, w, h, tint);
+    return;
+  }
+  if (tint.a == 0) {
+    return;
+  }
+  BlitKernel kernel = blit_select(dst, src->premultiplied, tint);
+  bmp_blit_oriented(dst, src, dx, dy, sx, sy, w, h, flip, &kernel, tint);
+}
+
+void bmp_blit_flip(Bitmap* dst, Bitmap* src, int dx, int dy, int sx, int sy, int w, int h, int flip) {
+  if (flip == 0) {
+    bmp_blit(dst, src, dx, dy, sx, sy, w, h);
+    return;
+  }
+  if (dst->blit_mode > BLEND_ALPHA) {
+    bmp_blit_flip_tint(dst, src, dx, dy, sx, sy, w, h, flip, (Color){0xff, 0xff, 0xff, 0xff});
+    return;
+  }
+  bmp_blit_oriented(dst, src, dx, dy, sx, sy, w, h, flip, nullptr, (Color){0});
+}
+
+// Fits insets [a] and [b] of a [size] span to [dsize] pixels, shrinking them if they do not fit.
+void slice_axis(int size, int a, int b, int dsize, int src[4], int dst[4]) {
+  a = a < 0 ? 0 : a > size ? size : a;
+  b = b < 0 ? 0 : b > size - a ? size - a : b;
+  int da = a, db = b;
+  if (a + b > dsize) {
+    da = a + b > 0 ? a * dsize / (a + b) : 0;
+    db = dsize - da;
+  }
+  src[0] = 0, src[1] = a, src[2] = size - b, src[3] = size;
+  dst[0] = 0, dst[1] = da, dst[2] = dsize - db, dst[3] = dsize;
+}
+
+// Draws a [w] x [h] panel whose edges and middle tile, or scale with [stretch].
+void bmp_nine_slice(Bitmap* dst, Bitmap* src, int sx, int sy, int sw, int sh, int left, int top, int right,
+                    int bottom, int x, int y, int w, int h, Color tint, bool stretch) {
+  if (tint.a == 0 || w <= 0 || h <= 0 || sw <= 0 || sh <= 0) {
+    return;
+  }
+
+  int su[4], du[4], sv[4], dv[4];
+  slice_axis(sw, left, right, w, su, du);
+  slice_axis(sh, top, bottom, h, sv, dv);
+  BlitKernel kernel = blit_select(dst, src->premultiplied, tint);
+
+  for (int j = 0; j < 3; j++) {
+    int ph = sv[j + 1] - sv[j];
+    if (ph <= 0) {
+      continue;
+    }
+    for (int i = 0; i < 3; i++) {
+      int pw = su[i + 1] - su[i];
+      if (pw <= 0) {
+        continue;
+      }
+      if (stretch && (i == 1 || j == 1)) {
+        int cw = i == 1 || du[i + 1] - du[i] > pw ? pw : du[i + 1] - du[i];
+        int ch = j == 1 || dv[j + 1] - dv[j] > ph ? ph : dv[j + 1] - dv[j];
+        Transform tf = {(float)(x + du[i]), (float)(y + dv[j]), 0, i == 1 ? (float)(du[2] - du[1]) / pw : 1,
+                        j == 1 ? (float)(dv[2] - dv[1]) / ph : 1, 0, 0};
+        bmp_blit_ex(dst, src, sx + su[i], sy + sv[j], cw, ch, &tf, tint);
+        continue;
+      }
+      // Corners keep their source size even when squeezed, so they crop.
+      for (int ty = dv[j]; ty < dv[j + 1]; ty += ph) {
+        int th = dv[j + 1] - ty < ph ? dv[j + 1] - ty : ph;
+        for (int tx = du[i]; tx < du[i + 1]; tx += pw) {
+          int tw = du[i + 1] - tx < pw ? du[i + 1] - tx : pw;
+          bmp_blit_kernel(dst, src, x + tx, y + ty, sx + su[i], sy + sv[j], tw, th, tint, kernel);
+        }
+      }
+    }
+  }
+}
+
+// SHAPES
+
+// Shapes fill scanline spans once per pixel; outlines are filled pixels with a neighbour outside.
+enum {
+  RULE_EVEN_ODD = 0,
+  RULE_NON_ZERO = 1,
+};
+
+typedef struct {
+  int x0, y0, x1, y1;
+} Clip;
+
+// Clips a shape's bounding box and marks it drawn, or returns false when none of it shows.
+bool shape_begin(Bitmap* bmp, long long x0, long long y0, long long x1, long long y1, Clip* clip) {
+  clip->x0 = bmp->cx;
+  clip->y0 = bmp->cy;
+  clip->x1 = bmp->cx + (bmp->cw >= 0 ? bmp->cw : bmp->w);
+  clip->y1 = bmp->cy + (bmp->ch >= 0 ? bmp->ch : bmp->h);
+  x0 = x0 > clip->x0 ? x0 : clip->x0;
+  y0 = y0 > clip->y0 ? y0 : clip->y0;
+  x1 = x1 < clip->x1 ? x1 : clip->x1;
+  y1 = y1 < clip->y1 ? y1 : clip->y1;
+  if (x0 >= x1 || y0 >= y1) {
+    return false;
+  }
+  bmp_touch(bmp, (int)x0, (int)y0, (int)(x1 - x0), (int)(y1 - y0));
+  return true;
+}
+
+void shape_span(Bitmap* bmp, Clip* clip, int y, long long x0, long long x1, Color color, int a) {
+  if (y < clip->y0 || y >= clip->y1) {
+    return;
+  }
+  x0 = x0 > clip->x0 ? x0 : clip->x0;
+  x1 = x1 < clip->x1 ? x1 : clip->x1;
+  if (x0 < x1) {
+    bmp_layout(bmp)->blend_area(bmp, (int)x0, y, (int)x1, y + 1, color, a, bmp->blit_mode);
+  }
+}
+
+// Half the width of row [dy] of an ellipse, or -1 outside it. The radii are
+// padded by half a pixel so small circles look round.
+int ellipse_half(int rx, int ry, long long dy) {
+  if (dy < -ry || dy > ry) {
+    return -1;
+  }
+  double t = dy / (ry + 0.5);
+  return (int)floor((rx + 0.5) * sqrt(1 - t * t));
+}
+
+// Only the rows of an ellipse inside the clip are walked.
+void bmp_ellipse(Bitmap* bmp, int x, int y, int rx, int ry, Color color) {
+  Clip clip;
+  if (rx < 0 || ry < 0 ||
+      !shape_begin(bmp, (long long)x - rx, (long long)y - ry, (long long)x + rx + 1, (long long)y + ry + 1, &clip)) {
+    return;
+  }
+  int xa = EXPAND(color.a);
+  int y0 = (long long)y - ry > clip.y0 ? y - ry : clip.y0;
+  int y1 = (long long)y + ry + 1 < clip.y1 ? y + ry + 1 : clip.y1;
+  for (int row = y0; row < y1; row++) {
+    int w = ellipse_half(rx, ry, (long long)row - y);
+    shape_span(bmp, &clip, row, (long long)x - w, (long long)x + w + 1, color, xa * xa);
+  }
+}
+
+void bmp_ellipse_line(Bitmap* bmp, int x, int y, int rx, int ry, Color color) {
+  Clip clip;
+  if (rx < 0 || ry < 0 ||
+      !shape_begin(bmp, (long long)x - rx, (long long)y - ry, (long long)x + rx + 1, (long long)y + ry + 1, &clip)) {
+    return;
+  }
+  int xa = EXPAND(color.a);
+  int y0 = (long long)y - ry > clip.y0 ? y - ry : clip.y0;
+  int y1 = (long long)y + ry + 1 < clip.y1 ? y + ry + 1 : clip.y1;
+  for (int row = y0; row < y1; row++) {
+    long long dy = (long long)row - y;
+    int w = ellipse_half(rx, ry, dy);
+    int above = ellipse_half(rx, ry, dy - 1);
+    int below = ellipse_half(rx, ry, dy + 1);
+    int m = above < below ? above : below;
+    m = m < w - 1 ? m : w - 1;
+    if (m < 0) {
+      shape_span(bmp, &clip, row, (long long)x - w, (long long)x + w + 1, color, xa * xa);
+    } else {
+      shape_span(bmp, &clip, row, (long long)x - w, (long long)x - m, color, xa * xa);
+      shape_span(bmp, &clip, row, (long long)x + m + 1, (long long)x + w + 1, color, xa * xa);
+    }
+  }
+}
+
+typedef struct {
+  double x;
+  int dir;
+} Crossing;
+
+// Fills [n] points of x, y pairs with [rule], sampling pixel centers against half-open edges.
+void bmp_polygon(Bitmap* bmp, const float* points, int n, int rule, Color color) {
+  if (n < 3) {
+    return;
+  }
+
+  float min_x = points[0], min_y = points[1], max_x = points[0], max_y = points[1];
+  for (int i = 1; i < n; i++) {
+    min_x = points[i * 2] < min_x ? points[i * 2] : min_x;
+    min_y = points[i * 2 + 1] < min_y ? points[i * 2 + 1] : min_y;
+    max_x = points[i * 2] > max_x ? points[i * 2] : max_x;
+    max_y = points[i * 2 + 1] > max_y ? points[i * 2 + 1] : max_y;
+  }
+
+  Clip clip;
+  if (!shape_begin(bmp, (int)floorf(min_x), (int)floorf(min_y), (int)ceilf(max_x) + 1, (int)ceilf(max_y) + 1,
+                   &clip)) {
+    return;
+  }
+
+  Crossing* xs = (Crossing*)malloc(n * sizeof(Crossing));
+  if (!xs) {
+    return;
+  }
+
+  int xa = EXPAND(color.a);
+  int y0 = (int)floorf(min_y) > clip.y0 ? (int)floorf(min_y) : clip.y0;
+  int y1 = (int)ceilf(max_y) + 1 < clip.y1 ? (int)ceilf(max_y) + 1 : clip.y1;
+  for (int y = y0; y < y1; y++) {
+    double yc = y + 0.5;
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+      double ax = points[i * 2], ay = points[i * 2 + 1];
+      double bx = points[(i + 1) % n * 2], by = points[(i + 1) % n * 2 + 1];
+      if ((ay <= yc && yc < by) || (by <= yc && yc < ay)) {
+        Crossing c = {ax + (yc - ay) * (bx - ax) / (by - ay), by > ay ? 1 : -1};
+        int k = count++;
+        while (k > 0 && xs[k - 1].x > c.x) {
+          xs[k] = xs[k - 1];
+          k--;
+        }
+        xs[k] = c;
+      }
+    }
+
+    int wind = 0;
+    for (int k = 0; k < count; k++) {
+      bool inside = rule == RULE_NON_ZERO ? wind != 0 : (k & 1);
+      wind += xs[k].dir;
+      if (inside && k > 0) {
+        shape_span(bmp, &clip, y, (int)ceil(xs[k - 1].x - 0.5), (int)ceil(xs[k].x - 0.5), color, xa * xa);
+      }
+    }
+  }
+
+  free(xs);
+}
+
+void bmp_polygon_line(Bitmap* bmp, const float* points, int n, Color color) {
+  for (int i = 0; i < n; i++) {
+    int j = (i + 1) % n;
+    bmp_line(bmp, (int)floorf(points[i * 2]), (int)floorf(points[i * 2 + 1]), (int)floorf(points[j * 2]),
+             (int)floorf(points[j * 2 + 1]), color);
+  }
+}
+
+typedef struct {
+  int x, y;
+} FillSeed;
+
+bool color_near(Color a, Color b, int tolerance) {
+  if (tolerance == 0) {
+    int x, y;
+    memcpy(&x, &a, sizeof(x));
+    memcpy(&y, &b, sizeof(y));
+    return x == y;
+  }
+  return abs(a.r - b.r) <= tolerance && abs(a.g - b.g) <= tolerance && abs(a.b - b.b) <= tolerance &&
+         abs(a.a - b.a) <= tolerance;
+}
+
+// Seeds the matching runs next to rows [y0, y1), or returns true when the stack is full.
+bool fill_reseed(Bitmap* bmp, Clip* clip, unsigned char* seen, Color target, int tolerance, int x0, int x1, int y0,
+                 int y1, FillSeed* stack, int cap, int* n) {
+  int cw = clip->x1 - clip->x0;
+  for (int y = y0; y < y1; y++) {
+    unsigned char* mark = &seen[(y - clip->y0) * cw - clip->x0];
+    for (int ny = y - 1; ny <= y + 1; ny += 2) {
+      if (ny < clip->y0 || ny >= clip->y1) {
+        continue;
+      }
+      Color* next = &bmp->data[ny * bmp->stride];
+      unsigned char* next_mark = &seen[(ny - clip->y0) * cw - clip->x0];
+      bool run = false;
+      for (int i = x0; i < x1; i++) {
+        bool open = mark[i] && !next_mark[i] && color_near(next[i], target, tolerance);
+        if (open && !run) {
+          if (*n == cap) {
+            return true;
+          }
+          stack[(*n)++] = (FillSeed){i, ny};
+        }
+        run = open;
+      }
+    }
+  }
+  return false;
+}
+
+// Scanline-fills the region within [tolerance] of the color at [x], [y], each pixel once.
+void bmp_flood_fill(Bitmap* bmp, int x, int y, Color color, int tolerance) {
+  Clip clip = {
+      bmp->cx > 0 ? bmp->cx : 0,
+      bmp->cy > 0 ? bmp->cy : 0,
+      bmp->cw >= 0 && bmp->cx + bmp->cw < bmp->w ? bmp->cx + bmp->cw : bmp->w,
+      bmp->ch >= 0 && bmp->cy + bmp->ch < bmp->h ? bmp->cy + bmp->ch : bmp->h,
+  };
+  if (x < clip.x0 || y < clip.y0 || x >= clip.x1 || y >= clip.y1) {
+    return;
+  }
+
+  int cw = clip.x1 - clip.x0;
+  unsigned char* seen = (unsigned char*)calloc((size_t)cw * (clip.y1 - clip.y0), 1);
+  int cap = 256, n = 0;
+  FillSeed* stack = (FillSeed*)malloc(cap * sizeof(FillSeed));
+  if (!seen || !stack) {
+    free(seen);
+    free(stack);
+    return;
+  }
+
+  Color target = bmp->data[y * bmp->stride + x];
+  int xa = EXPAND(color.a);
+  int bx0 = x, by0 = y, bx1 = x + 1, by1 = y + 1;
+  tolerance = tolerance > 0 ? tolerance : 0;
+  stack[n++] = (FillSeed){x, y};
+  bool dropped = false;
+
+  while (n > 0 || dropped) {
+    if (n == 0) {
+      dropped = fill_reseed(bmp, &clip, seen, target, tolerance, bx0, bx1, by0, by1, stack, cap, &n);
+      continue;
+    }
+
+    FillSeed s = stack[--n];
+    Color* row = &bmp->data[s.y * bmp->stride];
+    unsigned char* mark = &seen[(s.y - clip.y0) * cw - clip.x0];
+    if (mark[s.x]) {
+      continue;
+    }
+
+    int x0 = s.x, x1 = s.x + 1;
+    while (x0 > clip.x0 && !mark[x0 - 1] && color_near(row[x0 - 1], target, tolerance)) {
+      x0--;
+    }
+    while (x1 < clip.x1 && !mark[x1] && color_near(row[x1], target, tolerance)) {
+      x1++;
+    }
+    memset(&mark[x0], 1, x1 - x0);
+    cover_blend(bmp, x0, s.y, &row[x0], x1 - x0, color, xa * xa, bmp->blit_mode);
+
+    bx0 = x0 < bx0 ? x0 : bx0;
+    bx1 = x1 > bx1 ? x1 : bx1;
+    by0 = s.y < by0 ? s.y : by0;
+    by1 = s.y + 1 > by1 ? s.y + 1 : by1;
+
+    for (int ny = s.y - 1; ny <= s.y + 1; ny += 2) {
+      if (ny < clip.y0 || ny >= clip.y1) {
+        continue;
+      }
+      Color* next = &bmp->data[ny * bmp->stride];
+      unsigned char* next_mark = &seen[(ny - clip.y0) * cw - clip.x0];
+      bool run = false;
+      for (int i = x0; i < x1; i++) {
+        bool open = !next_mark[i] && color_near(next[i], target, tolerance);
+        if (open && !run) {
+          if (n == cap) {
+            FillSeed* grown = (FillSeed*)realloc(stack, cap * 2 * sizeof(FillSeed));
+            if (grown) {
+              stack = grown;
+              cap *= 2;
+            }
+          }
+          if (n < cap) {
+            stack[n++] = (FillSeed){i, ny};
+          } else {
+            dropped = true;
+          }
+        }
+        run = open;
+      }
+    }
+  }
+
+  bmp_touch(bmp, bx0, by0, bx1 - bx0, by1 - by0);
+  free(seen);
+  free(stack);
+}
+
+// SPRITES
+
+#define RUN_MIN 16
+
+// A bitmap region compiled into skip, copy and blend runs, merging runs under RUN_MIN.
+typedef struct {
+  unsigned short kind, len;
+} Run;
+
+typedef struct {
+  int run, pixel;
+} SpriteRow;
+
+typedef struct {
+  int w, h;
+  int refs;
+  bool premultiplied;
+  SpriteRow* rows;
+  Run* runs;
+  Color* data;
+} Sprite;
+
+// Returns nullptr when the sprite cannot be allocated.
+Sprite* sprite_compile(Bitmap* bmp, int x, int y, int w, int h) {
+  if (x < 0) {
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (x + w > bmp->w) {
+    w = bmp->w - x;
+  }
+  if (y + h > bmp->h) {
+    h = bmp->h - y;
+  }
+  if (w < 0 || h < 0) {
+    w = h = 0;
+  }
+
+  SpriteRow* rows = (SpriteRow*)malloc((h + 1) * sizeof(SpriteRow));
+  Run* runs = (Run*)malloc((w * h + 1) * sizeof(Run));
+  if (!rows || !runs) {
+    free(rows);
+    free(runs);
+    return nullptr;
+  }
+  int num_runs = 0;
+  int num_pixels = 0;
+
+  for (int j = 0; j < h; j++) {
+    Color* row = &bmp->data[(y + j) * bmp->stride + x];
+    rows[j] = (SpriteRow){num_runs, num_pixels};
+
+    int i = 0;
+    while (i < w) {
+      int kind = SPAN_KIND(row[i].a);
+      int i1 = i + 1;
+      while (i1 < w && SPAN_KIND(row[i1].a) == kind && i1 - i < 0xffff) {
+        i1++;
+      }
+
+      if (i1 - i < RUN_MIN) {
+        kind = SPAN_BLEND;
+      }
+      if (num_runs > rows[j].run && kind == SPAN_BLEND && runs[num_runs - 1].kind == SPAN_BLEND &&
+          runs[num_runs - 1].len + (i1 - i) <= 0xffff) {
+        runs[num_runs - 1].len += i1 - i;
+      } else {
+        runs[num_runs++] = (Run){kind, i1 - i};
+      }
+      if (kind != SPAN_SKIP) {
+        num_pixels += i1 - i;
+      }
+      i = i1;
+    }
+  }
+  rows[h] = (SpriteRow){num_runs, num_pixels};
+
+  size_t rows_size = (h + 1) * sizeof(SpriteRow);
+  size_t runs_size = (num_runs * sizeof(Run) + sizeof(Color) - 1) / sizeof(Color) * sizeof(Color);
+  Sprite* spr = (Sprite*)malloc(sizeof(Sprite) + rows_size + runs_size + num_pixels * sizeof(Color));
+  if (!spr) {
+    free(rows);
+    free(runs);
+    return nullptr;
+  }
+  spr->w = w;
+  spr->h = h;
+  spr->refs = 1;
+  spr->premultiplied = bmp->premultiplied;
+  spr->rows = (SpriteRow*)(spr + 1);
+  spr->runs = (Run*)((char*)spr->rows + rows_size);
+  spr->data = (Color*)((char*)spr->runs + runs_size);
+  memcpy(spr->rows, rows, rows_size);
+  memcpy(spr->runs, runs, num_runs * sizeof(Run));
+
+  Color* td = spr->data;
+  for (int j = 0; j < h; j++) {
+    Color* row = &bmp->data[(y + j) * bmp->stride + x];
+    int i = 0;
+    for (Run* run = &runs[rows[j].run]; run < &runs[rows[j + 1].run]; run++) {
+      if (run->kind != SPAN_SKIP) {
+        memcpy(td, &row[i], run->len * sizeof(Color));
+        td += run->len;
+      }
+      i += run->len;
+    }
+  }
+
+  free(rows);
+  free(runs);
+  return spr;
+}
+
+void sprite_destroy(Sprite* spr) {
+  if (--spr->refs > 0) {
+    return;
+  }
+  free(spr);
+}
+
+void sprite_blit(Bitmap* dst, Sprite* spr, int dx, int dy, Color tint) {
+  if (tint.a == 0) {
+    return;
+  }
+
+  int cx0 = dst->cx;
+  int cy0 = dst->cy;
+  int cx1 = cx0 + (dst->cw >= 0 ? dst->cw : dst->w);
+  int cy1 = cy0 + (dst->ch >= 0 ? dst->ch : dst->h);
+
+  int j0 = dy < cy0 ? cy0 - dy : 0;
+  int j1 = dy + spr->h > cy1 ? cy1 - dy : spr->h;
+  if (dx >= cx1 || dx + spr->w <= cx0) {
+    return;
+  }
+
+  bmp_touch(dst, dx > cx0 ? dx : cx0, dy + j0, (dx + spr->w < cx1 ? dx + spr->w : cx1) - (dx > cx0 ? dx : cx0),
+            j1 - j0);
+  BlitKernel kernel = blit_select(dst, spr->premultiplied, tint);
+  bool covers = blit_covers(dst, tint);
+  Layout* layout = bmp_layout(dst);
+  SpriteRow* rows = spr->rows;
+  Run* runs = spr->runs;
+  Color* data = spr->data;
+
+  for (int j = j0; j < j1; j++) {
+    Run* run = &runs[rows[j].run];
+    Run* end = &runs[rows[j + 1].run];
+    Color* ts = &data[rows[j].pixel];
+    int x = dx;
+
+    for (; run < end && x < cx1; run++) {
+      int x1 = x + run->len;
+      if (run->kind != SPAN_SKIP) {
+        if (x1 > cx0) {
+          int a = x > cx0 ? x : cx0;
+          int b = x1 < cx1 ? x1 : cx1;
+          BlitRowFn fn = run->kind == SPAN_OPAQUE ? kernel.opaque : kernel.blend;
+          layout->blit_at(dst, a, dy + j, ts + (a - x), b - a, tint, fn, covers ? run->kind : SPAN_SKIP);
+        }
+        ts += run->len;
+      }
+      x = x1;
+    }
+  }
+}
+
+// INDEXED BITMAPS
+
+// One palette index per pixel; indexed_update rebuilds colors and kinds after palette edits.
+typedef struct {
+  int w, h;
+  int refs;
+  int transparent;
+  Color palette[256];
+  Color colors[256];
+  unsigned char kinds[256];
+  unsigned char* data;
+} IndexedBitmap;
+
+void indexed_update(IndexedBitmap* bmp) {
+  for (int i = 0; i < 256; i++) {
+    bmp->colors[i] = bmp->palette[i];
+    if (i == bmp->transparent) {
+      bmp->colors[i].a = 0;
+    }
+    bmp->kinds[i] = (unsigned char)SPAN_KIND(bmp->colors[i].a);
+  }
+}
+
+IndexedBitmap* indexed_create(int w, int h) {
+  IndexedBitmap* bmp = (IndexedBitmap*)calloc(1, sizeof(IndexedBitmap) + (size_t)w * h);
+  if (!bmp) {
+    return nullptr;
+  }
+  bmp->w = w;
+  bmp->h = h;
+  bmp->refs = 1;
+  bmp->transparent = -1;
+  bmp->data = (unsigned char*)(bmp + 1);
+  indexed_update(bmp);
+  return bmp;
+}
+
+void indexed_destroy(IndexedBitmap* bmp) {
+  if (--bmp->refs > 0) {
+    return;
+  }
+  free(bmp);
+}
+
+unsigned int png_u32(const unsigned char* p) {
+  return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+int png_paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+}
+
+// Undoes the filters of [h] rows of [row_bytes] bytes, each after its filter type.
+bool png_unfilter(unsigned char* raw, int row_bytes, int h) {
+  for (int y = 0; y < h; y++) {
+    unsigned char* line = &raw[y * (row_bytes + 1) + 1];
+    unsigned char* prev = y > 0 ? line - (row_bytes + 1) : nullptr;
+    int filter = line[-1];
+    for (int i = 0; i < row_bytes; i++) {
+      int a = i > 0 ? line[i - 1] : 0;
+      int b = prev ? prev[i] : 0;
+      int c = prev && i > 0 ? prev[i - 1] : 0;
+      switch (filter) {
+        case 0:
+          break;
+        case 1:
+          line[i] += a;
+          break;
+        case 2:
+          line[i] += b;
+          break;
+        case 3:
+          line[i] += (a + b) / 2;
+          break;
+        case 4:
+          line[i] += png_paeth(a, b, c);
+          break;
+        default:
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Loads a paletted PNG keeping its indices, which stb_image would expand to RGBA.
+IndexedBitmap* indexed_load(void* data, int len) {
+  const unsigned char* p = (const unsigned char*)data;
+  if (!p || len < 8 || memcmp(p, "\x89PNG\r\n\x1a\n", 8) != 0) {
+    return nullptr;
+  }
+
+  int w = 0, h = 0, depth = 0, num_colors = 0;
+  bool paletted = false;
+  Color palette[256] = {0};
+  unsigned char* idat = nullptr;
+  size_t idat_len = 0;
+
+  for (size_t pos = 8; pos + 12 <= (size_t)len;) {
+    size_t n = png_u32(&p[pos]);
+    const unsigned char* type = &p[pos + 4];
+    const unsigned char* body = &p[pos + 8];
+    if (n > (size_t)len - pos - 12) {
+      break;
+    }
+
+    if (memcmp(type, "IHDR", 4) == 0 && n >= 13) {
+      w = (int)png_u32(body);
+      h = (int)png_u32(body + 4);
+      depth = body[8];
+      paletted = body[9] == 3 && body[12] == 0 && (depth == 1 || depth == 2 || depth == 4 || depth == 8);
+    } else if (memcmp(type, "PLTE", 4) == 0) {
+      num_colors = n / 3 < 256 ? (int)n / 3 : 256;
+      for (int i = 0; i < num_colors; i++) {
+        palette[i] = new_color(body[i * 3], body[i * 3 + 1], body[i * 3 + 2], 0xff);
+      }
+    } else if (memcmp(type, "tRNS", 4) == 0) {
+      for (size_t i = 0; i < n && i < 256; i++) {
+        palette[i].a = body[i];
+      }
+    } else if (memcmp(type, "IDAT", 4) == 0) {
+      unsigned char* grown = (unsigned char*)realloc(idat, idat_len + n);
+      if (!grown) {
+        free(idat);
+        return nullptr;
+      }
+      idat = grown;
+      memcpy(idat + idat_len, body, n);
+      idat_len += n;
+    } else if (memcmp(type, "IEND", 4) == 0) {
+      break;
+    }
+    pos += n + 12;
+  }
+
+  if (!paletted || num_colors == 0 || !idat || w <= 0 || h <= 0 || w > 1 << 14 || h > 1 << 14) {
+    free(idat);
+    return nullptr;
+  }
+
+  size_t raw_len = 0;
+  unsigned char* raw =
+      (unsigned char*)tinfl_decompress_mem_to_heap(idat, idat_len, &raw_len, TINFL_FLAG_PARSE_ZLIB_HEADER);
+  free(idat);
+  int row_bytes = (w * depth + 7) / 8;
+  IndexedBitmap* bmp = nullptr;
+  if (raw && raw_len >= (size_t)(row_bytes + 1) * h && png_unfilter(raw, row_bytes, h)) {
+    bmp = indexed_create(w, h);
+  }
+  if (!bmp) {
+    mz_free(raw);
+    return nullptr;
+  }
+
+  int mask = (1 << depth) - 1;
+  for (int y = 0; y < h; y++) {
+    const unsigned char* line = &raw[y * (row_bytes + 1) + 1];
+    unsigned char* row = &bmp->data[y * w];
+    for (int x = 0; x < w; x++) {
+      int bit = x * depth;
+      row[x] = (unsigned char)(line[bit / 8] >> (8 - depth - bit % 8) & mask);
+    }
+  }
+  mz_free(raw);
+
+  memcpy(bmp->palette, palette, sizeof(palette));
+  for (int i = 0; i < 256; i++) {
+    if (i < num_colors && palette[i].a == 0) {
+      bmp->transparent = i;
+      break;
+    }
+  }
+  indexed_update(bmp);
+  return bmp;
+}
+
+// Expands rows through the palette in chunks and blits them like bmp_blit_kernel.
+void indexed_blit(Bitmap* dst, IndexedBitmap* src, int dx, int dy, int sx, int sy, int w, int h) {
+  int cw = dst->cw >= 0 ? dst->cw : dst->w;
+  int ch = dst->ch >= 0 ? dst->ch : dst->h;
+
+  CLIP();
+
+  bmp_touch(dst, dx, dy, w, h);
+
+  Color white = {0xff, 0xff, 0xff, 0xff};
+  BlitKernel kernel = blit_select(dst, false, white);
+  bool covers = blit_covers(dst, white);
+  const Color* colors = src->colors;
+  const unsigned char* kinds = src->kinds;
+  Color buf[256];
+  unsigned char cells[256 / SPAN_SIZE];
+
+  Layout* layout = bmp_layout(dst);
+  const unsigned char* ts = &src->data[sy * src->w + sx];
+  do {
+    for (int x = 0; x < w; x += 256) {
+      int n = w - x < 256 ? w - x : 256;
+      int num_cells = (n + SPAN_SIZE - 1) / SPAN_SIZE;
+      for (int c = 0; c < num_cells; c++) {
+        int i1 = (c + 1) * SPAN_SIZE < n ? (c + 1) * SPAN_SIZE : n;
+        int kind = kinds[ts[x + c * SPAN_SIZE]];
+        for (int i = c * SPAN_SIZE; i < i1; i++) {
+          buf[i] = colors[ts[x + i]];
+          kind = kinds[ts[x + i]] == kind ? kind : SPAN_BLEND;
+        }
+        cells[c] = (unsigned char)kind;
+      }
+
+      for (int c = 0; c < num_cells;) {
+        int c1 = c + 1;
+        while (c1 < num_cells && cells[c1] == cells[c]) {
+          c1++;
+        }
+        if (cells[c] != SPAN_SKIP) {
+          int i0 = c * SPAN_SIZE;
+          int i1 = c1 * SPAN_SIZE < n ? c1 * SPAN_SIZE : n;
+          BlitRowFn fn = cells[c] == SPAN_OPAQUE ? kernel.opaque : kernel.blend;
+          layout->blit_at(dst, dx + x + i0, dy, buf + i0, i1 - i0, white, fn, covers ? cells[c] : SPAN_SKIP);
+        }
+        c = c1;
+      }
+    }
+    ts += src->w;
+    dy++;
+  } while (--h);
+}
+
+// FONTS
+
+typedef struct {
+  int code, x, y, w, h;
+} Glyph;
 
 typedef struct {
   Bitmap* bitmap;
@@ -446,136 +2902,713 @@ bool load_glyphs(Font* font) {
   for (int index = 0; index < font->num_glyphs; index++) {
     g = &font->glyphs[index];
 
-    scan(font->bitmap, &x, &y, &rowh);
+    scan(font->bitmap, &x, &y, &rowh);
+
+    if (y >= font->bitmap->h) {
+      return false;
+    }
+
+    w = h = 0;
+    while (!border(font->bitmap, x + w, y)) {
+      w++;
+    }
+
+    while (!border(font->bitmap, x, y + h)) {
+      h++;
+    }
+
+    if (index < 96) {
+      g->code = index + 32;
+    } else {
+      g->code = cp1252[index - 96];
+    }
+
+    g->x = x;
+    g->y = y;
+    g->w = w;
+    g->h = h;
+    x += w;
+    if (h != font->glyphs[0].h) {
+      return false;
+    }
+
+    if (h > rowh) {
+      rowh = h;
+    }
+  }
+
+  for (int i = 1; i < font->num_glyphs; i++) {
+    int j = i;
+    Glyph g = font->glyphs[i];
+    while (j > 0 && font->glyphs[j - 1].code > g.code) {
+      font->glyphs[j] = font->glyphs[j - 1];
+      j--;
+    }
+    font->glyphs[j] = g;
+  }
+
+  return true;
+}
+
+void font_destroy(Font* font) {
+  bmp_destroy(font->bitmap);
+  free(font->glyphs);
+  free(font);
+}
+
+Font* font_load(Bitmap* bitmap) {
+  Font* font = (Font*)calloc(1, sizeof(Font));
+  font->bitmap = bitmap;
+  if (!load_glyphs(font)) {
+    font_destroy(font);
+    return nullptr;
+  }
+  return font;
+}
+
+Glyph* get(Font* font, int code) {
+  unsigned lo = 0, hi = font->num_glyphs;
+  while (lo < hi) {
+    unsigned guess = (lo + hi) / 2;
+    if (code < font->glyphs[guess].code)
+      hi = guess;
+    else
+      lo = guess + 1;
+  }
+
+  if (lo == 0 || font->glyphs[lo - 1].code != code)
+    return &font->glyphs['?' - 32];
+  else
+    return &font->glyphs[lo - 1];
+}
+
+int font_text_width(Font* font, const char* text) {
+  int x = 0, w = 0, c;
+
+  while (*text) {
+    text = decode_utf8(text, &c);
+    if (c == '\n' || c == '\r') {
+      x = 0;
+    } else {
+      x += get(font, c)->w;
+      w = (x > w) ? x : w;
+    }
+  }
+  return w;
+}
+
+// Like font_text_width, but a carriage return is not a line break.
+int font_print_width(Font* font, const char* text) {
+  int x = 0, w = 0, c;
+
+  while (*text) {
+    text = decode_utf8(text, &c);
+    if (c == '\n') {
+      x = 0;
+    } else if (c != '\r') {
+      x += get(font, c)->w;
+      w = (x > w) ? x : w;
+    }
+  }
+  return w;
+}
+
+int font_text_height(Font* font, const char* text) {
+  int rowh, h, c;
+
+  h = rowh = get(font, 0)->h;
+  while (*text) {
+    text = decode_utf8(text, &c);
+    if (c == '\n' && *text)
+      h += rowh;
+  }
+  return h;
+}
+
+void font_print(Bitmap* dest, Font* font, int x, int y, Color color, const char* text) {
+  Glyph* g;
+  const char* p;
+  int start = x, c;
+
+  if (color.a == 0) {
+    return;
+  }
+  BlitKernel kernel = blit_select(dest, font->bitmap->premultiplied, color);
+
+  p = text;
+  while (*p) {
+    p = decode_utf8(p, &c);
+    if (c == '\r')
+      continue;
+    if (c == '\n') {
+      x = start;
+      y += font_text_height(font, "");
+      continue;
+    }
+    g = get(font, c);
+    bmp_blit_kernel(dest, font->bitmap, x, y, g->x, g->y, g->w, g->h, color, kernel);
+    x += g->w;
+  }
+}
+
+// COMMAND BUFFER
+
+enum {
+  CMD_CLEAR,
+  CMD_PLOT,
+  CMD_LINE,
+  CMD_RECT,
+  CMD_RECT_LINE,
+  CMD_BLIT,
+  CMD_BLIT_TINT,
+  CMD_BLIT_EX,
+  CMD_BLIT_FLIP,
+  CMD_BLIT_FLIP_TINT,
+  CMD_NINE_SLICE,
+  CMD_ELLIPSE,
+  CMD_ELLIPSE_LINE,
+  CMD_POLYGON,
+  CMD_POLYGON_LINE,
+  CMD_FLOOD_FILL,
+  CMD_SPRITE,
+  CMD_BLIT_INDEXED,
+  CMD_TEXT,
+};
+
+// How far back a new command may look for a batch to join.
+#define CMD_WINDOW 64
+
+// A recorded drawing call with the clip and blit mode of dst; bx0..by1 bound it in root coordinates.
+typedef struct {
+  int type;
+  Bitmap* dst;
+  Bitmap* src;
+  Sprite* spr;
+  IndexedBitmap* ibmp;
+  Font* font;
+  int x, y, w, h;
+  int sx, sy;
+  Color color;
+  Transform tf;
+  int flip;
+  int sw, sh;
+  int left, top, right, bottom;
+  bool stretch;
+  float* points;
+  int num_points;
+  int rule;
+  int tolerance;
+  int cx, cy, cw, ch;
+  int blit_mode;
+  int text;
+  int bx0, by0, bx1, by1;
+} Command;
+
+typedef struct {
+  Command* cmds;
+  int num_cmds, cmds_cap;
+  char* text;
+  int text_len, text_cap;
+} CommandBuffer;
+
+void cmd_bounds(Command* cmd) {
+  Bitmap* dst = cmd->dst;
+  int x0 = 0, y0 = 0, x1 = dst->w, y1 = dst->h;
+
+  switch (cmd->type) {
+    case CMD_PLOT:
+      x0 = cmd->x;
+      y0 = cmd->y;
+      x1 = cmd->x + 1;
+      y1 = cmd->y + 1;
+      break;
+    case CMD_LINE:
+      x0 = cmd->x < cmd->sx ? cmd->x : cmd->sx;
+      y0 = cmd->y < cmd->sy ? cmd->y : cmd->sy;
+      x1 = (cmd->x > cmd->sx ? cmd->x : cmd->sx) + 1;
+      y1 = (cmd->y > cmd->sy ? cmd->y : cmd->sy) + 1;
+      break;
+    case CMD_BLIT_EX:
+      transform_bounds(&cmd->tf, cmd->w, cmd->h, &x0, &y0, &x1, &y1);
+      break;
+    case CMD_ELLIPSE:
+    case CMD_ELLIPSE_LINE:
+      // Huge radii stop at the int range, which the clip then cuts down.
+      x0 = (long long)cmd->x - cmd->w > INT_MIN ? cmd->x - cmd->w : INT_MIN;
+      y0 = (long long)cmd->y - cmd->h > INT_MIN ? cmd->y - cmd->h : INT_MIN;
+      x1 = (long long)cmd->x + cmd->w + 1 < INT_MAX ? cmd->x + cmd->w + 1 : INT_MAX;
+      y1 = (long long)cmd->y + cmd->h + 1 < INT_MAX ? cmd->y + cmd->h + 1 : INT_MAX;
+      break;
+    case CMD_POLYGON:
+    case CMD_POLYGON_LINE:
+      x0 = x1 = (int)floorf(cmd->points[0]);
+      y0 = y1 = (int)floorf(cmd->points[1]);
+      for (int i = 1; i < cmd->num_points; i++) {
+        int px = (int)floorf(cmd->points[i * 2]);
+        int py = (int)floorf(cmd->points[i * 2 + 1]);
+        x0 = px < x0 ? px : x0;
+        y0 = py < y0 ? py : y0;
+        x1 = px > x1 ? px : x1;
+        y1 = py > y1 ? py : y1;
+      }
+      x1 += 2;
+      y1 += 2;
+      break;
+    case CMD_BLIT_FLIP:
+    case CMD_BLIT_FLIP_TINT:
+      x0 = cmd->x;
+      y0 = cmd->y;
+      x1 = cmd->x + (cmd->flip & ROTATE_90 ? cmd->h : cmd->w);
+      y1 = cmd->y + (cmd->flip & ROTATE_90 ? cmd->w : cmd->h);
+      break;
+    case CMD_RECT:
+    case CMD_RECT_LINE:
+    case CMD_BLIT:
+    case CMD_BLIT_TINT:
+    case CMD_NINE_SLICE:
+    case CMD_SPRITE:
+    case CMD_BLIT_INDEXED:
+    case CMD_TEXT:
+      x0 = cmd->x;
+      y0 = cmd->y;
+      x1 = cmd->x + cmd->w;
+      y1 = cmd->y + cmd->h;
+      break;
+  }
+
+  int cx1 = cmd->cx + (cmd->cw >= 0 ? cmd->cw : dst->w);
+  int cy1 = cmd->cy + (cmd->ch >= 0 ? cmd->ch : dst->h);
+  x0 = x0 > cmd->cx ? x0 : cmd->cx;
+  y0 = y0 > cmd->cy ? y0 : cmd->cy;
+  x1 = x1 < cx1 ? x1 : cx1;
+  y1 = y1 < cy1 ? y1 : cy1;
+
+  if (x1 <= x0 || y1 <= y0) {
+    x0 = y0 = x1 = y1 = 0;
+  }
+
+  cmd->bx0 = x0 + dst->ox;
+  cmd->by0 = y0 + dst->oy;
+  cmd->bx1 = x1 + dst->ox;
+  cmd->by1 = y1 + dst->oy;
+}
+
+// Whether b must stay after a: they draw to overlapping pixels of the same
+// root, or one reads a root the other draws to.
+bool cmd_depends(Command* a, Command* b) {
+  if (a->dst->root != b->dst->root) {
+    return (a->src && a->src->root == b->dst->root) || (b->src && b->src->root == a->dst->root);
+  }
+  if ((a->src && a->src->root == b->dst->root) || (b->src && b->src->root == a->dst->root)) {
+    return true;
+  }
+  return a->bx0 < b->bx1 && b->bx0 < a->bx1 && a->by0 < b->by1 && b->by0 < a->by1;
+}
+
+// Commands in one batch read the same source through the same kernels.
+bool cmd_batches(Command* a, Command* b) {
+  return a->type == b->type && a->dst->root == b->dst->root && a->src == b->src && a->spr == b->spr &&
+         a->ibmp == b->ibmp && a->blit_mode == b->blit_mode && tint_kind(a->color) == tint_kind(b->color);
+}
+
+// Appends a command, moving it back into a batch when nothing in between depends on it.
+bool cmdbuf_push(CommandBuffer* buf, Command* cmd, const char* text) {
+  if (buf->num_cmds == buf->cmds_cap) {
+    int cap = buf->cmds_cap ? buf->cmds_cap * 2 : 256;
+    Command* cmds = (Command*)realloc(buf->cmds, cap * sizeof(Command));
+    if (!cmds) {
+      return false;
+    }
+    buf->cmds = cmds;
+    buf->cmds_cap = cap;
+  }
+
+  int len = text ? (int)strlen(text) + 1 : 0;
+  if (buf->text_len + len > buf->text_cap) {
+    int cap = (buf->text_len + len) * 2;
+    char* chars = (char*)realloc(buf->text, cap);
+    if (!chars) {
+      return false;
+    }
+    buf->text = chars;
+    buf->text_cap = cap;
+  }
+
+  if (cmd->points) {
+    float* points = (float*)malloc(cmd->num_points * 2 * sizeof(float));
+    if (!points) {
+      return false;
+    }
+    memcpy(points, cmd->points, cmd->num_points * 2 * sizeof(float));
+    cmd->points = points;
+  }
+
+  if (text) {
+    memcpy(buf->text + buf->text_len, text, len);
+    cmd->text = buf->text_len;
+    buf->text_len += len;
+  }
+
+  cmd_bounds(cmd);
+  cmd->dst->refs++;
+  if (cmd->src) {
+    cmd->src->refs++;
+  }
+  if (cmd->spr) {
+    cmd->spr->refs++;
+  }
+  if (cmd->ibmp) {
+    cmd->ibmp->refs++;
+  }
+
+  int pos = buf->num_cmds;
+  int stop = buf->num_cmds > CMD_WINDOW ? buf->num_cmds - CMD_WINDOW : 0;
+  for (int i = buf->num_cmds - 1; i >= stop; i--) {
+    if (cmd_batches(&buf->cmds[i], cmd)) {
+      pos = i + 1;
+      break;
+    }
+    if (cmd_depends(&buf->cmds[i], cmd)) {
+      break;
+    }
+  }
+
+  memmove(&buf->cmds[pos + 1], &buf->cmds[pos], (buf->num_cmds - pos) * sizeof(Command));
+  buf->cmds[pos] = *cmd;
+  buf->num_cmds++;
+  return true;
+}
+
+// Flood fills read data directly, so they bypass the layout of their target.
+bool cmd_has_layout(int type) {
+  return type != CMD_FLOOD_FILL;
+}
+
+// Commands without a layout path draw into data, staged under their bounds.
+void cmd_execute(Command* cmd, const char* text) {
+  Bitmap* dst = cmd->dst;
+  Layout* layout = bmp_layout(dst);
+  if (layout->expand && !cmd_has_layout(cmd->type)) {
+    Command c = *cmd;
+    cmd_bounds(&c);
+    int x0 = c.bx0 > 0 ? c.bx0 : 0;
+    int y0 = c.by0 > 0 ? c.by0 : 0;
+    int x1 = c.bx1 < dst->w ? c.bx1 : dst->w;
+    int y1 = c.by1 < dst->h ? c.by1 : dst->h;
+    if (x1 <= x0 || y1 <= y0) {
+      return;
+    }
+
+    Bitmap stage = *dst;
+    stage.blocks = nullptr;
+    c.dst = &stage;
+    layout->expand(dst, x0, y0, x1, y1);
+    cmd_execute(&c, text);
+    layout->pack(dst, x0, y0, x1, y1);
+    return;
+  }
+
+  int cx = dst->cx, cy = dst->cy, cw = dst->cw, ch = dst->ch;
+  int blit_mode = dst->blit_mode;
+
+  bmp_clip(dst, cmd->cx, cmd->cy, cmd->cw, cmd->ch);
+  bmp_blit_mode(dst, cmd->blit_mode);
+
+  switch (cmd->type) {
+    case CMD_CLEAR:
+      bmp_clear(dst, cmd->color);
+      break;
+    case CMD_PLOT:
+      bmp_plot(dst, cmd->x, cmd->y, cmd->color);
+      break;
+    case CMD_LINE:
+      bmp_line(dst, cmd->x, cmd->y, cmd->sx, cmd->sy, cmd->color);
+      break;
+    case CMD_RECT:
+      bmp_rect(dst, cmd->x, cmd->y, cmd->w, cmd->h, cmd->color);
+      break;
+    case CMD_RECT_LINE:
+      bmp_rect_line(dst, cmd->x, cmd->y, cmd->w, cmd->h, cmd->color);
+      break;
+    case CMD_BLIT:
+      bmp_blit(dst, cmd->src, cmd->x, cmd->y, cmd->sx, cmd->sy, cmd->w, cmd->h);
+      break;
+    case CMD_BLIT_TINT:
+      bmp_blit_tint(dst, cmd->src, cmd->x, cmd->y, cmd->sx, cmd->sy, cmd->w, cmd->h, cmd->color);
+      break;
+    case CMD_BLIT_EX:
+      bmp_blit_ex(dst, cmd->src, cmd->sx, cmd->sy, cmd->w, cmd->h, &cmd->tf, cmd->color);
+      break;
+    case CMD_BLIT_FLIP:
+      bmp_blit_flip(dst, cmd->src, cmd->x, cmd->y, cmd->sx, cmd->sy, cmd->w, cmd->h, cmd->flip);
+      break;
+    case CMD_BLIT_FLIP_TINT:
+      bmp_blit_flip_tint(dst, cmd->src, cmd->x, cmd->y, cmd->sx, cmd->sy, cmd->w, cmd->h, cmd->flip, cmd->color);
+      break;
+    case CMD_ELLIPSE:
+      bmp_ellipse(dst, cmd->x, cmd->y, cmd->w, cmd->h, cmd->color);
+      break;
+    case CMD_ELLIPSE_LINE:
+      bmp_ellipse_line(dst, cmd->x, cmd->y, cmd->w, cmd->h, cmd->color);
+      break;
+    case CMD_POLYGON:
+      bmp_polygon(dst, cmd->points, cmd->num_points, cmd->rule, cmd->color);
+      break;
+    case CMD_POLYGON_LINE:
+      bmp_polygon_line(dst, cmd->points, cmd->num_points, cmd->color);
+      break;
+    case CMD_FLOOD_FILL:
+      bmp_flood_fill(dst, cmd->x, cmd->y, cmd->color, cmd->tolerance);
+      break;
+    case CMD_NINE_SLICE:
+      bmp_nine_slice(dst, cmd->src, cmd->sx, cmd->sy, cmd->sw, cmd->sh, cmd->left, cmd->top, cmd->right, cmd->bottom,
+                     cmd->x, cmd->y, cmd->w, cmd->h, cmd->color, cmd->stretch);
+      break;
+    case CMD_SPRITE:
+      sprite_blit(dst, cmd->spr, cmd->x, cmd->y, cmd->color);
+      break;
+    case CMD_BLIT_INDEXED:
+      indexed_blit(dst, cmd->ibmp, cmd->x, cmd->y, cmd->sx, cmd->sy, cmd->w, cmd->h);
+      break;
+    case CMD_TEXT:
+      font_print(dst, cmd->font, cmd->x, cmd->y, cmd->color, text);
+      break;
+  }
+
+  bmp_clip(dst, cx, cy, cw, ch);
+  bmp_blit_mode(dst, blit_mode);
+}
 
-    if (y >= font->bitmap->h) {
-      return false;
+void cmdbuf_reset(CommandBuffer* buf) {
+  for (int i = 0; i < buf->num_cmds; i++) {
+    Command* cmd = &buf->cmds[i];
+    bmp_destroy(cmd->dst);
+    if (cmd->src) {
+      bmp_destroy(cmd->src);
     }
-
-    w = h = 0;
-    while (!border(font->bitmap, x + w, y)) {
-      w++;
+    if (cmd->spr) {
+      sprite_destroy(cmd->spr);
     }
-
-    while (!border(font->bitmap, x, y + h)) {
-      h++;
+    if (cmd->ibmp) {
+      indexed_destroy(cmd->ibmp);
     }
+    free(cmd->points);
+  }
+  buf->num_cmds = 0;
+  buf->text_len = 0;
+}
 
-    if (index < 96) {
-      g->code = index + 32;
-    } else {
-      g->code = cp1252[index - 96];
-    }
+void cmdbuf_free(CommandBuffer* buf) {
+  cmdbuf_reset(buf);
+  free(buf->cmds);
+  free(buf->text);
+}
 
-    g->x = x;
-    g->y = y;
-    g->w = w;
-    g->h = h;
-    x += w;
-    if (h != font->glyphs[0].h) {
-      return false;
-    }
+// RASTER THREADS
 
-    if (h > rowh) {
-      rowh = h;
-    }
-  }
+#define TILE_W 64
+#define TILE_H 32
+#define MAX_THREADS 16
+#define MAX_TILES 1024
 
-  for (int i = 1; i < font->num_glyphs; i++) {
-    int j = i;
-    Glyph g = font->glyphs[i];
-    while (j > 0 && font->glyphs[j - 1].code > g.code) {
-      font->glyphs[j] = font->glyphs[j - 1];
-      j--;
-    }
-    font->glyphs[j] = g;
+// Threads replay the commands binned to each tile in order, so results match one thread.
+typedef struct {
+  int num_threads;
+  int num_workers;
+  HANDLE start[MAX_THREADS];
+  HANDLE done;
+  volatile long next_tile;
+  volatile long pending;
+
+  Command* cmds;
+  const char* text;
+  Bitmap* dst;
+  int tiles_x, num_tiles;
+  int* bins;
+  int bins_cap;
+  int bin_start[MAX_TILES + 1];
+} RasterPool;
+
+RasterPool raster = {.num_threads = 1};
+
+void raster_tile(int t) {
+  Bitmap* dst = raster.dst;
+  int x0 = t % raster.tiles_x * TILE_W;
+  int y0 = t / raster.tiles_x * TILE_H;
+  int x1 = x0 + TILE_W < dst->w ? x0 + TILE_W : dst->w;
+  int y1 = y0 + TILE_H < dst->h ? y0 + TILE_H : dst->h;
+
+  // A private header per thread; coverage words never straddle tiles.
+  Bitmap tile = *dst;
+  tile.root = &tile;
+  tile.damage = nullptr;
+
+  for (int i = raster.bin_start[t]; i < raster.bin_start[t + 1]; i++) {
+    Command* cmd = &raster.cmds[raster.bins[i]];
+    Command c = *cmd;
+    c.dst = &tile;
+    c.cx = cmd->bx0 > x0 ? cmd->bx0 : x0;
+    c.cy = cmd->by0 > y0 ? cmd->by0 : y0;
+    c.cw = (cmd->bx1 < x1 ? cmd->bx1 : x1) - c.cx;
+    c.ch = (cmd->by1 < y1 ? cmd->by1 : y1) - c.cy;
+    cmd_execute(&c, cmd->type == CMD_TEXT ? raster.text + cmd->text : nullptr);
   }
-
-  return true;
 }
 
-void font_destroy(Font* font) {
-  bmp_destroy(font->bitmap);
-  free(font->glyphs);
-  free(font);
+void raster_work(void) {
+  long t;
+  while ((t = InterlockedIncrement(&raster.next_tile) - 1) < raster.num_tiles) {
+    raster_tile((int)t);
+  }
 }
 
-Font* font_load(Bitmap* bitmap) {
-  Font* font = (Font*)calloc(1, sizeof(Font));
-  font->bitmap = bitmap;
-  if (!load_glyphs(font)) {
-    font_destroy(font);
-    return nullptr;
+// Each worker has its own start semaphore, so a batch wakes only the workers it uses.
+DWORD WINAPI raster_worker(LPVOID param) {
+  HANDLE start = (HANDLE)param;
+  while (true) {
+    WaitForSingleObject(start, INFINITE);
+    raster_work();
+    if (InterlockedDecrement(&raster.pending) == 0) {
+      ReleaseSemaphore(raster.done, 1, nullptr);
+    }
   }
-  return font;
+  return 0;
 }
 
-Glyph* get(Font* font, int code) {
-  unsigned lo = 0, hi = font->num_glyphs;
-  while (lo < hi) {
-    unsigned guess = (lo + hi) / 2;
-    if (code < font->glyphs[guess].code)
-      hi = guess;
-    else
-      lo = guess + 1;
+// Sets how many threads rasterize, the calling thread included.
+void raster_threads(int n) {
+  n = n < 1 ? 1 : (n > MAX_THREADS ? MAX_THREADS : n);
+  if (!raster.done) {
+    raster.done = CreateSemaphore(nullptr, 0, 1, nullptr);
   }
-
-  if (lo == 0 || font->glyphs[lo - 1].code != code)
-    return &font->glyphs['?' - 32];
-  else
-    return &font->glyphs[lo - 1];
+  while (raster.num_workers < n - 1) {
+    HANDLE start = CreateSemaphore(nullptr, 0, 1, nullptr);
+    HANDLE thread = CreateThread(nullptr, 0, raster_worker, start, 0, nullptr);
+    if (!thread) {
+      CloseHandle(start);
+      break;
+    }
+    CloseHandle(thread);
+    raster.start[raster.num_workers++] = start;
+  }
+  raster.num_threads = n < raster.num_workers + 1 ? n : raster.num_workers + 1;
 }
 
-int font_text_width(Font* font, const char* text) {
-  int x = 0, w = 0, c;
+void raster_run(Command* cmds, int num_cmds, const char* text) {
+  Bitmap* dst = cmds[0].dst;
+  int tiles_x = (dst->w + TILE_W - 1) / TILE_W;
+  int tiles_y = (dst->h + TILE_H - 1) / TILE_H;
 
-  while (*text) {
-    text = decode_utf8(text, &c);
-    if (c == '\n' || c == '\r') {
-      x = 0;
+  // Sources are classified up front: workers only read them.
+  for (int i = 0; i < num_cmds; i++) {
+    if (cmds[i].src && cmds[i].src->root->dirty) {
+      bmp_classify(cmds[i].src);
+    }
+  }
+
+  // Bins are stored back to back: count, prefix sum, then fill in order.
+  memset(raster.bin_start, 0, sizeof(raster.bin_start));
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < num_cmds; i++) {
+      Command* cmd = &cmds[i];
+      int x0 = cmd->bx0 > 0 ? cmd->bx0 : 0;
+      int y0 = cmd->by0 > 0 ? cmd->by0 : 0;
+      int x1 = cmd->bx1 < dst->w ? cmd->bx1 : dst->w;
+      int y1 = cmd->by1 < dst->h ? cmd->by1 : dst->h;
+      if (x1 <= x0 || y1 <= y0) {
+        continue;
+      }
+      int tx0 = x0 / TILE_W;
+      int ty0 = y0 / TILE_H;
+      int tx1 = (x1 - 1) / TILE_W;
+      int ty1 = (y1 - 1) / TILE_H;
+      for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+          int t = ty * tiles_x + tx;
+          if (pass == 0) {
+            raster.bin_start[t + 1]++;
+          } else {
+            raster.bins[raster.bin_start[t]++] = i;
+          }
+        }
+      }
+    }
+
+    if (pass == 0) {
+      for (int t = 0; t < tiles_x * tiles_y; t++) {
+        raster.bin_start[t + 1] += raster.bin_start[t];
+      }
+      int total = raster.bin_start[tiles_x * tiles_y];
+      if (total > raster.bins_cap) {
+        int* bins = (int*)realloc(raster.bins, total * 2 * sizeof(int));
+        if (!bins) {
+          // Without room for the bins the batch draws on this thread.
+          for (int i = 0; i < num_cmds; i++) {
+            cmd_execute(&cmds[i], cmds[i].type == CMD_TEXT ? text + cmds[i].text : nullptr);
+          }
+          return;
+        }
+        raster.bins = bins;
+        raster.bins_cap = total * 2;
+      }
     } else {
-      x += get(font, c)->w;
-      w = (x > w) ? x : w;
+      memmove(&raster.bin_start[1], &raster.bin_start[0], tiles_x * tiles_y * sizeof(int));
+      raster.bin_start[0] = 0;
     }
   }
-  return w;
-}
 
-int font_text_height(Font* font, const char* text) {
-  int rowh, h, c;
+  raster.cmds = cmds;
+  raster.text = text;
+  raster.dst = dst;
+  raster.tiles_x = tiles_x;
+  raster.num_tiles = tiles_x * tiles_y;
+  raster.next_tile = 0;
+  raster.pending = raster.num_threads - 1;
 
-  h = rowh = get(font, 0)->h;
-  while (*text) {
-    text = decode_utf8(text, &c);
-    if (c == '\n' && *text)
-      h += rowh;
+  for (int i = 0; i < raster.num_threads - 1; i++) {
+    ReleaseSemaphore(raster.start[i], 1, nullptr);
+  }
+  raster_work();
+  WaitForSingleObject(raster.done, INFINITE);
+
+  dst->dirty = true;
+  if (dst->damage) {
+    for (int i = 0; i < num_cmds; i++) {
+      Command* cmd = &cmds[i];
+      damage_add(dst->damage, cmd->bx0 > 0 ? cmd->bx0 : 0, cmd->by0 > 0 ? cmd->by0 : 0,
+                 cmd->bx1 < dst->w ? cmd->bx1 : dst->w, cmd->by1 < dst->h ? cmd->by1 : dst->h);
+    }
   }
-  return h;
 }
 
-void font_print(Bitmap* dest, Font* font, int x, int y, Color color, const char* text) {
-  Glyph* g;
-  const char* p;
-  int start = x, c;
+// Runs a buffer in order, handing runs of commands on one root to the thread pool.
+void cmdbuf_run(CommandBuffer* buf) {
+  int i = 0;
+  while (i < buf->num_cmds) {
+    Command* cmd = &buf->cmds[i];
+    Bitmap* dst = cmd->dst;
+    int j = i + 1;
+
+    int tiles = ((dst->w + TILE_W - 1) / TILE_W) * ((dst->h + TILE_H - 1) / TILE_H);
+    if (raster.num_threads > 1 && tiles <= MAX_TILES && dst->root == dst && !(cmd->src && cmd->src->root == dst)) {
+      while (j < buf->num_cmds && buf->cmds[j].dst == dst && !(buf->cmds[j].src && buf->cmds[j].src->root == dst)) {
+        j++;
+      }
+    }
 
-  p = text;
-  while (*p) {
-    p = decode_utf8(p, &c);
-    if (c == '\r')
-      continue;
-    if (c == '\n') {
-      x = start;
-      y += font_text_height(font, "");
-      continue;
+    if (j - i > 1) {
+      raster_run(cmd, j - i, buf->text);
+    } else {
+      cmd_execute(cmd, cmd->type == CMD_TEXT ? buf->text + cmd->text : nullptr);
     }
-    g = get(font, c);
-    bmp_blit_tint(dest, font->bitmap, x, y, g->x, g->y, g->w, g->h, color);
-    x += g->w;
+    i = j;
   }
 }
 
 // STATE
 
+#define MAX_TARGETS 16
+
 typedef struct {
   HWND hwnd;
   HDC hdc;
@@ -594,6 +3627,14 @@ typedef struct {
   Bitmap* font_bmp;
   Font* font;
 
+  Bitmap* target;
+  Bitmap* targets[MAX_TARGETS];
+  int num_targets;
+
+  bool deferred;
+  CommandBuffer commands;
+  CommandBuffer last_commands;
+
   WrenVM* vm;
   WrenHandle* twig_handle;
   WrenHandle* mouse_move_handler;
@@ -603,6 +3644,78 @@ typedef struct {
   const char* keys[512];
 } State;
 
+// Drops every render target pushed with Graphics.target, so a script that
+// forgets resetTarget still draws each frame to the screen.
+void reset_targets(State* state) {
+  while (state->num_targets > 0) {
+    bmp_destroy(state->target);
+    state->target = state->targets[--state->num_targets];
+  }
+}
+
+// Starts a command for the current target with its current clip and mode.
+Command graphics_command(State* state, int type) {
+  Bitmap* dst = state->target;
+  return (Command){
+      .type = type,
+      .dst = dst,
+      .cx = dst->cx,
+      .cy = dst->cy,
+      .cw = dst->cw,
+      .ch = dst->ch,
+      .blit_mode = dst->blit_mode,
+  };
+}
+
+// Runs the deferred commands recorded so far and keeps them for replay.
+void graphics_flush(State* state) {
+  if (state->commands.num_cmds == 0) {
+    return;
+  }
+  cmdbuf_run(&state->commands);
+
+  CommandBuffer last = state->last_commands;
+  cmdbuf_reset(&last);
+  state->last_commands = state->commands;
+  state->commands = last;
+}
+
+// A deferred command that cannot be recorded draws now, after the ones
+// recorded before it.
+void graphics_submit(State* state, Command* cmd, const char* text) {
+  if (state->deferred) {
+    if (cmdbuf_push(&state->commands, cmd, text)) {
+      return;
+    }
+    graphics_flush(state);
+  }
+  cmd_execute(cmd, text);
+}
+
+// Pushes the damaged rectangles to the window, pointing the DIB at each one's first row.
+void graphics_present(State* state) {
+  Bitmap* bmp = state->bmp;
+  Damage* damage = bmp->damage;
+
+  for (int i = 0; i < damage->num_rects; i++) {
+    DamageRect* r = &damage->rects[i];
+    int x0 = state->dx + r->x0 * state->dw / bmp->w;
+    int y0 = state->dy + r->y0 * state->dh / bmp->h;
+    int x1 = state->dx + r->x1 * state->dw / bmp->w;
+    int y1 = state->dy + r->y1 * state->dh / bmp->h;
+
+    if (bmp->blocks) {
+      bmp_deswizzle(bmp, r->x0, r->y0, r->x1, r->y1);
+    }
+    state->bmi->bmiHeader.biHeight = -(LONG)(r->y1 - r->y0);
+    StretchDIBits(state->hdc, x0, y0, x1 - x0, y1 - y0, r->x0, 0, r->x1 - r->x0, r->y1 - r->y0,
+                  &bmp->data[r->y0 * bmp->stride], state->bmi, DIB_RGB_COLORS, SRCCOPY);
+  }
+
+  state->bmi->bmiHeader.biHeight = -(LONG)bmp->h;
+  damage->num_rects = 0;
+}
+
 // WREN API
 
 void wren_write(WrenVM* vm, const char* text) {
@@ -637,61 +3750,279 @@ void load_module_complete(WrenVM* vm, const char* module, WrenLoadModuleResult r
 WrenLoadModuleResult wren_load_module(WrenVM* vm, const char* name) {
   (void)vm;
 
-  WrenLoadModuleResult result = {0};
+  WrenLoadModuleResult result = {0};
+
+  if (strcmp(name, "random") == 0 || strcmp(name, "meta") == 0) {
+    return result;
+  }
+
+  char full_name[256];
+  snprintf(full_name, sizeof(full_name), "%s.wren", name);
+
+  result.onComplete = load_module_complete;
+  result.source = read_data(full_name, nullptr);
+  return result;
+}
+
+void wren_bitmap_allocate(WrenVM* vm) {
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotNewForeign(vm, 0, 0, sizeof(Bitmap*));
+}
+
+void wren_bitmap_finalize(void* data) {
+  Bitmap** bmp = (Bitmap**)data;
+  bmp_destroy(*bmp);
+}
+
+void wren_bitmap_new(WrenVM* vm) {
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+
+  int w = (int)wrenGetSlotDouble(vm, 1);
+  int h = (int)wrenGetSlotDouble(vm, 2);
+
+  *bmp = bmp_create(w, h);
+}
+
+void wren_bitmap_load(WrenVM* vm) {
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+
+  const char* filename = wrenGetSlotString(vm, 1);
+  bool premultiplied = wrenGetSlotCount(vm) > 2 && wrenGetSlotBool(vm, 2);
+
+  size_t size;
+  char* data = read_data(filename, &size);
+
+  *bmp = bmp_load(data, size, premultiplied);
+  free(data);
+}
+
+void wren_bitmap_region(WrenVM* vm) {
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+
+  Bitmap** parent = (Bitmap**)wrenGetSlotForeign(vm, 1);
+  int x = (int)wrenGetSlotDouble(vm, 2);
+  int y = (int)wrenGetSlotDouble(vm, 3);
+  int w = (int)wrenGetSlotDouble(vm, 4);
+  int h = (int)wrenGetSlotDouble(vm, 5);
+
+  *bmp = bmp_view(*parent, x, y, w, h);
+}
+
+void wren_bitmap_width(WrenVM* vm) {
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+  wrenSetSlotDouble(vm, 0, (*bmp)->w);
+}
+
+void wren_bitmap_height(WrenVM* vm) {
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+  wrenSetSlotDouble(vm, 0, (*bmp)->h);
+}
+
+void wren_bitmap_stride(WrenVM* vm) {
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+  wrenSetSlotDouble(vm, 0, (*bmp)->stride);
+}
+
+void wren_bitmap_premultiplied(WrenVM* vm) {
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+  wrenSetSlotBool(vm, 0, (*bmp)->premultiplied);
+}
+
+// Reads the area of getPixels and setPixels, aborting the fiber when it does
+// not lie inside the bitmap.
+bool wren_bitmap_area(WrenVM* vm, Bitmap* bmp, int* x, int* y, int* w, int* h) {
+  *x = (int)wrenGetSlotDouble(vm, 1);
+  *y = (int)wrenGetSlotDouble(vm, 2);
+  *w = (int)wrenGetSlotDouble(vm, 3);
+  *h = (int)wrenGetSlotDouble(vm, 4);
+
+  if (*x < 0 || *y < 0 || *w < 0 || *h < 0 || *w > bmp->w - *x || *h > bmp->h - *y) {
+    wrenSetSlotString(vm, 0, "pixel area out of bounds");
+    wrenAbortFiber(vm, 0);
+    return false;
+  }
+  return true;
+}
+
+void wren_bitmap_get_pixels(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+
+  int x, y, w, h;
+  if (!wren_bitmap_area(vm, *bmp, &x, &y, &w, &h)) {
+    return;
+  }
+
+  size_t size = (size_t)w * h * 4;
+  unsigned char* bytes = (unsigned char*)malloc(size ? size : 1);
+  if (!bytes) {
+    wrenSetSlotString(vm, 0, "failed to allocate pixels");
+    wrenAbortFiber(vm, 0);
+    return;
+  }
+
+  graphics_flush(state);
+  bmp_read(*bmp, x, y, w, h, bytes);
+  wrenSetSlotBytes(vm, 0, (const char*)bytes, size);
+  free(bytes);
+}
+
+void wren_bitmap_set_pixels(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+
+  int x, y, w, h;
+  if (!wren_bitmap_area(vm, *bmp, &x, &y, &w, &h)) {
+    return;
+  }
+
+  if (wrenGetSlotType(vm, 5) != WREN_TYPE_STRING) {
+    wrenSetSlotString(vm, 0, "pixels must be a string");
+    wrenAbortFiber(vm, 0);
+    return;
+  }
+
+  int length;
+  const char* bytes = wrenGetSlotBytes(vm, 5, &length);
+  if ((size_t)length != (size_t)w * h * 4) {
+    wrenSetSlotString(vm, 0, "pixels must hold four bytes per pixel");
+    wrenAbortFiber(vm, 0);
+    return;
+  }
+
+  graphics_flush(state);
+  bmp_write(*bmp, x, y, w, h, (const unsigned char*)bytes);
+}
+
+void wren_sprite_allocate(WrenVM* vm) {
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotNewForeign(vm, 0, 0, sizeof(Sprite*));
+}
+
+void wren_sprite_finalize(void* data) {
+  Sprite** spr = (Sprite**)data;
+  if (*spr) {
+    sprite_destroy(*spr);
+  }
+}
+
+void wren_sprite_new(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  Sprite** spr = (Sprite**)wrenGetSlotForeign(vm, 0);
+
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 1);
+  int x = (int)wrenGetSlotDouble(vm, 2);
+  int y = (int)wrenGetSlotDouble(vm, 3);
+  int w = (int)wrenGetSlotDouble(vm, 4);
+  int h = (int)wrenGetSlotDouble(vm, 5);
+
+  graphics_flush(state);
+  *spr = sprite_compile(*bmp, x, y, w, h);
 
-  if (strcmp(name, "random") == 0 || strcmp(name, "meta") == 0) {
-    return result;
+  if (!*spr) {
+    wrenSetSlotString(vm, 0, "failed to allocate sprite");
+    wrenAbortFiber(vm, 0);
   }
-
-  char full_name[256];
-  snprintf(full_name, sizeof(full_name), "%s.wren", name);
-
-  result.onComplete = load_module_complete;
-  result.source = read_data(full_name, nullptr);
-  return result;
 }
 
-void wren_bitmap_allocate(WrenVM* vm) {
-  wrenEnsureSlots(vm, 1);
-  wrenSetSlotNewForeign(vm, 0, 0, sizeof(Bitmap*));
+void wren_sprite_width(WrenVM* vm) {
+  Sprite** spr = (Sprite**)wrenGetSlotForeign(vm, 0);
+  wrenSetSlotDouble(vm, 0, (*spr)->w);
 }
 
-void wren_bitmap_finalize(void* data) {
-  Bitmap** bmp = (Bitmap**)data;
-  bmp_destroy(*bmp);
+void wren_sprite_height(WrenVM* vm) {
+  Sprite** spr = (Sprite**)wrenGetSlotForeign(vm, 0);
+  wrenSetSlotDouble(vm, 0, (*spr)->h);
 }
 
-void wren_bitmap_new(WrenVM* vm) {
-  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
-
-  int w = (int)wrenGetSlotDouble(vm, 1);
-  int h = (int)wrenGetSlotDouble(vm, 2);
+void wren_indexed_bitmap_allocate(WrenVM* vm) {
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotNewForeign(vm, 0, 0, sizeof(IndexedBitmap*));
+}
 
-  *bmp = bmp_create(w, h);
+void wren_indexed_bitmap_finalize(void* data) {
+  IndexedBitmap** bmp = (IndexedBitmap**)data;
+  if (*bmp) {
+    indexed_destroy(*bmp);
+  }
 }
 
-void wren_bitmap_load(WrenVM* vm) {
-  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+void wren_indexed_bitmap_load(WrenVM* vm) {
+  IndexedBitmap** bmp = (IndexedBitmap**)wrenGetSlotForeign(vm, 0);
 
   const char* filename = wrenGetSlotString(vm, 1);
 
   size_t size;
   char* data = read_data(filename, &size);
 
-  *bmp = bmp_load(data, size);
+  *bmp = indexed_load(data, (int)size);
   free(data);
+
+  if (!*bmp) {
+    wrenSetSlotString(vm, 0, "not a paletted png");
+    wrenAbortFiber(vm, 0);
+  }
 }
 
-void wren_bitmap_width(WrenVM* vm) {
-  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+void wren_indexed_bitmap_width(WrenVM* vm) {
+  IndexedBitmap** bmp = (IndexedBitmap**)wrenGetSlotForeign(vm, 0);
   wrenSetSlotDouble(vm, 0, (*bmp)->w);
 }
 
-void wren_bitmap_height(WrenVM* vm) {
-  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 0);
+void wren_indexed_bitmap_height(WrenVM* vm) {
+  IndexedBitmap** bmp = (IndexedBitmap**)wrenGetSlotForeign(vm, 0);
   wrenSetSlotDouble(vm, 0, (*bmp)->h);
 }
 
+void wren_indexed_bitmap_transparent(WrenVM* vm) {
+  IndexedBitmap** bmp = (IndexedBitmap**)wrenGetSlotForeign(vm, 0);
+  wrenSetSlotDouble(vm, 0, (*bmp)->transparent);
+}
+
+// Palette edits wait for the deferred commands recorded so far, which still
+// draw with the old colors.
+void wren_indexed_bitmap_set_transparent(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  IndexedBitmap** bmp = (IndexedBitmap**)wrenGetSlotForeign(vm, 0);
+
+  int index = (int)wrenGetSlotDouble(vm, 1);
+
+  graphics_flush(state);
+  (*bmp)->transparent = index >= 0 && index < 256 ? index : -1;
+  indexed_update(*bmp);
+}
+
+void wren_indexed_bitmap_color(WrenVM* vm) {
+  IndexedBitmap** bmp = (IndexedBitmap**)wrenGetSlotForeign(vm, 0);
+
+  int index = (int)wrenGetSlotDouble(vm, 1);
+  Color color = (*bmp)->palette[index & 0xff];
+
+  wrenEnsureSlots(vm, 2);
+  wrenSetSlotNewList(vm, 0);
+  unsigned char channels[4] = {color.r, color.g, color.b, color.a};
+  for (int i = 0; i < 4; i++) {
+    wrenSetSlotDouble(vm, 1, channels[i]);
+    wrenInsertInList(vm, 0, -1, 1);
+  }
+}
+
+void wren_indexed_bitmap_set_color(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  IndexedBitmap** bmp = (IndexedBitmap**)wrenGetSlotForeign(vm, 0);
+
+  int index = (int)wrenGetSlotDouble(vm, 1);
+
+  unsigned char r = (unsigned char)wrenGetSlotDouble(vm, 2);
+  unsigned char g = (unsigned char)wrenGetSlotDouble(vm, 3);
+  unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 4);
+  unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 5);
+
+  graphics_flush(state);
+  (*bmp)->palette[index & 0xff] = new_color(r, g, b, a);
+  indexed_update(*bmp);
+}
+
 void wren_graphics_clip(WrenVM* vm) {
   State* state = (State*)wrenGetUserData(vm);
 
@@ -700,7 +4031,7 @@ void wren_graphics_clip(WrenVM* vm) {
   int cw = (int)wrenGetSlotDouble(vm, 3);
   int ch = (int)wrenGetSlotDouble(vm, 4);
 
-  bmp_clip(state->bmp, cx, cy, cw, ch);
+  bmp_clip(state->target, cx, cy, cw, ch);
 }
 
 void wren_graphics_blit_mode(WrenVM* vm) {
@@ -709,9 +4040,17 @@ void wren_graphics_blit_mode(WrenVM* vm) {
   const char* mode = wrenGetSlotString(vm, 1);
 
   if (strcmp(mode, "keep") == 0) {
-    bmp_blit_mode(state->bmp, KEEP_ALPHA);
+    bmp_blit_mode(state->target, KEEP_ALPHA);
   } else if (strcmp(mode, "blend") == 0) {
-    bmp_blit_mode(state->bmp, BLEND_ALPHA);
+    bmp_blit_mode(state->target, BLEND_ALPHA);
+  } else if (strcmp(mode, "add") == 0) {
+    bmp_blit_mode(state->target, BLEND_ADD);
+  } else if (strcmp(mode, "multiply") == 0) {
+    bmp_blit_mode(state->target, BLEND_MULTIPLY);
+  } else if (strcmp(mode, "screen") == 0) {
+    bmp_blit_mode(state->target, BLEND_SCREEN);
+  } else if (strcmp(mode, "subtract") == 0) {
+    bmp_blit_mode(state->target, BLEND_SUBTRACT);
   }
 }
 
@@ -723,7 +4062,9 @@ void wren_graphics_clear(WrenVM* vm) {
   unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 3);
   unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 4);
 
-  bmp_clear(state->bmp, new_color(r, g, b, a));
+  Command cmd = graphics_command(state, CMD_CLEAR);
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
 }
 
 void wren_graphics_plot(WrenVM* vm) {
@@ -737,7 +4078,11 @@ void wren_graphics_plot(WrenVM* vm) {
   unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 5);
   unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 6);
 
-  bmp_plot(state->bmp, x, y, new_color(r, g, b, a));
+  Command cmd = graphics_command(state, CMD_PLOT);
+  cmd.x = x;
+  cmd.y = y;
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
 }
 
 void wren_graphics_line(WrenVM* vm) {
@@ -754,7 +4099,13 @@ void wren_graphics_line(WrenVM* vm) {
   unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 7);
   unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 8);
 
-  bmp_line(state->bmp, x0, y0, x1, y1, new_color(r, g, b, a));
+  Command cmd = graphics_command(state, CMD_LINE);
+  cmd.x = x0;
+  cmd.y = y0;
+  cmd.sx = x1;
+  cmd.sy = y1;
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
 }
 
 void wren_graphics_rect(WrenVM* vm) {
@@ -770,7 +4121,13 @@ void wren_graphics_rect(WrenVM* vm) {
   unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 7);
   unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 8);
 
-  bmp_rect(state->bmp, x, y, w, h, new_color(r, g, b, a));
+  Command cmd = graphics_command(state, CMD_RECT);
+  cmd.x = x;
+  cmd.y = y;
+  cmd.w = w;
+  cmd.h = h;
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
 }
 
 void wren_graphics_rect_line(WrenVM* vm) {
@@ -786,7 +4143,111 @@ void wren_graphics_rect_line(WrenVM* vm) {
   unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 7);
   unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 8);
 
-  bmp_rect_line(state->bmp, x, y, w, h, new_color(r, g, b, a));
+  Command cmd = graphics_command(state, CMD_RECT_LINE);
+  cmd.x = x;
+  cmd.y = y;
+  cmd.w = w;
+  cmd.h = h;
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
+}
+
+void wren_graphics_ellipse_type(WrenVM* vm, int type) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  int x = (int)wrenGetSlotDouble(vm, 1);
+  int y = (int)wrenGetSlotDouble(vm, 2);
+  int rx = (int)wrenGetSlotDouble(vm, 3);
+  int ry = (int)wrenGetSlotDouble(vm, 4);
+
+  unsigned char r = (unsigned char)wrenGetSlotDouble(vm, 5);
+  unsigned char g = (unsigned char)wrenGetSlotDouble(vm, 6);
+  unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 7);
+  unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 8);
+
+  Command cmd = graphics_command(state, type);
+  cmd.x = x;
+  cmd.y = y;
+  cmd.w = rx;
+  cmd.h = ry;
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
+}
+
+void wren_graphics_ellipse(WrenVM* vm) {
+  wren_graphics_ellipse_type(vm, CMD_ELLIPSE);
+}
+
+void wren_graphics_ellipse_line(WrenVM* vm) {
+  wren_graphics_ellipse_type(vm, CMD_ELLIPSE_LINE);
+}
+
+// Submits a polygon whose points are a flat list of x, y numbers in slot 1.
+// The color follows in [color_slot].
+void wren_graphics_polygon_type(WrenVM* vm, int type, int rule, int color_slot) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  int count = wrenGetListCount(vm, 1) / 2;
+  if (count < 1) {
+    return;
+  }
+  float* points = (float*)malloc(count * 2 * sizeof(float));
+  if (!points) {
+    return;
+  }
+
+  int tmp = wrenGetSlotCount(vm);
+  wrenEnsureSlots(vm, tmp + 1);
+  for (int i = 0; i < count * 2; i++) {
+    wrenGetListElement(vm, 1, i, tmp);
+    points[i] = (float)wrenGetSlotDouble(vm, tmp);
+  }
+
+  unsigned char r = (unsigned char)wrenGetSlotDouble(vm, color_slot);
+  unsigned char g = (unsigned char)wrenGetSlotDouble(vm, color_slot + 1);
+  unsigned char b = (unsigned char)wrenGetSlotDouble(vm, color_slot + 2);
+  unsigned char a = (unsigned char)wrenGetSlotDouble(vm, color_slot + 3);
+
+  Command cmd = graphics_command(state, type);
+  cmd.points = points;
+  cmd.num_points = count;
+  cmd.rule = rule;
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
+  free(points);
+}
+
+void wren_graphics_polygon(WrenVM* vm) {
+  wren_graphics_polygon_type(vm, CMD_POLYGON, RULE_EVEN_ODD, 2);
+}
+
+void wren_graphics_polygon_rule(WrenVM* vm) {
+  const char* rule = wrenGetSlotString(vm, 2);
+  wren_graphics_polygon_type(vm, CMD_POLYGON, strcmp(rule, "nonzero") == 0 ? RULE_NON_ZERO : RULE_EVEN_ODD, 3);
+}
+
+void wren_graphics_polygon_line(WrenVM* vm) {
+  wren_graphics_polygon_type(vm, CMD_POLYGON_LINE, RULE_EVEN_ODD, 2);
+}
+
+void wren_graphics_fill(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  int x = (int)wrenGetSlotDouble(vm, 1);
+  int y = (int)wrenGetSlotDouble(vm, 2);
+
+  unsigned char r = (unsigned char)wrenGetSlotDouble(vm, 3);
+  unsigned char g = (unsigned char)wrenGetSlotDouble(vm, 4);
+  unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 5);
+  unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 6);
+
+  Command cmd = graphics_command(state, CMD_FLOOD_FILL);
+  cmd.src = state->target;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.color = new_color(r, g, b, a);
+  cmd.tolerance = (int)wrenGetSlotDouble(vm, 7);
+  graphics_submit(state, &cmd, nullptr);
 }
 
 void wren_graphics_blit(WrenVM* vm) {
@@ -800,7 +4261,15 @@ void wren_graphics_blit(WrenVM* vm) {
   int sw = (int)wrenGetSlotDouble(vm, 6);
   int sh = (int)wrenGetSlotDouble(vm, 7);
 
-  bmp_blit(state->bmp, *bmp, x, y, sx, sy, sw, sh);
+  Command cmd = graphics_command(state, CMD_BLIT);
+  cmd.src = *bmp;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.sx = sx;
+  cmd.sy = sy;
+  cmd.w = sw;
+  cmd.h = sh;
+  graphics_submit(state, &cmd, nullptr);
 }
 
 void wren_graphics_blit_alpha(WrenVM* vm) {
@@ -815,7 +4284,18 @@ void wren_graphics_blit_alpha(WrenVM* vm) {
   int sh = (int)wrenGetSlotDouble(vm, 7);
   float alpha = (float)wrenGetSlotDouble(vm, 8);
 
-  bmp_blit_alpha(state->bmp, *bmp, x, y, sx, sy, sw, sh, alpha);
+  alpha = (alpha < 0) ? 0 : (alpha > 1 ? 1 : alpha);
+
+  Command cmd = graphics_command(state, CMD_BLIT_TINT);
+  cmd.src = *bmp;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.sx = sx;
+  cmd.sy = sy;
+  cmd.w = sw;
+  cmd.h = sh;
+  cmd.color = new_color(0xff, 0xff, 0xff, (unsigned char)(alpha * 255));
+  graphics_submit(state, &cmd, nullptr);
 }
 
 void wren_graphics_blit_tint(WrenVM* vm) {
@@ -834,7 +4314,203 @@ void wren_graphics_blit_tint(WrenVM* vm) {
   unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 10);
   unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 11);
 
-  bmp_blit_tint(state->bmp, *bmp, x, y, sx, sy, sw, sh, new_color(r, g, b, a));
+  Command cmd = graphics_command(state, CMD_BLIT_TINT);
+  cmd.src = *bmp;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.sx = sx;
+  cmd.sy = sy;
+  cmd.w = sw;
+  cmd.h = sh;
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
+}
+
+void wren_graphics_blit_ex(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 1);
+
+  Command cmd = graphics_command(state, CMD_BLIT_EX);
+  cmd.src = *bmp;
+  cmd.tf.x = (float)wrenGetSlotDouble(vm, 2);
+  cmd.tf.y = (float)wrenGetSlotDouble(vm, 3);
+  cmd.sx = (int)wrenGetSlotDouble(vm, 4);
+  cmd.sy = (int)wrenGetSlotDouble(vm, 5);
+  cmd.w = (int)wrenGetSlotDouble(vm, 6);
+  cmd.h = (int)wrenGetSlotDouble(vm, 7);
+  cmd.tf.angle = (float)wrenGetSlotDouble(vm, 8);
+  cmd.tf.scale_x = (float)wrenGetSlotDouble(vm, 9);
+  cmd.tf.scale_y = (float)wrenGetSlotDouble(vm, 10);
+  cmd.tf.ox = (float)wrenGetSlotDouble(vm, 11);
+  cmd.tf.oy = (float)wrenGetSlotDouble(vm, 12);
+
+  unsigned char r = (unsigned char)wrenGetSlotDouble(vm, 13);
+  unsigned char g = (unsigned char)wrenGetSlotDouble(vm, 14);
+  unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 15);
+  unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 16);
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
+}
+
+int wren_get_flip(WrenVM* vm, int slot) {
+  int flip = 0;
+  if (wrenGetSlotBool(vm, slot)) {
+    flip |= FLIP_X;
+  }
+  if (wrenGetSlotBool(vm, slot + 1)) {
+    flip |= FLIP_Y;
+  }
+  if (wrenGetSlotBool(vm, slot + 2)) {
+    flip |= ROTATE_90;
+  }
+  return flip;
+}
+
+void wren_graphics_blit_flip(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 1);
+  int x = (int)wrenGetSlotDouble(vm, 2);
+  int y = (int)wrenGetSlotDouble(vm, 3);
+  int sx = (int)wrenGetSlotDouble(vm, 4);
+  int sy = (int)wrenGetSlotDouble(vm, 5);
+  int sw = (int)wrenGetSlotDouble(vm, 6);
+  int sh = (int)wrenGetSlotDouble(vm, 7);
+
+  Command cmd = graphics_command(state, CMD_BLIT_FLIP);
+  cmd.src = *bmp;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.sx = sx;
+  cmd.sy = sy;
+  cmd.w = sw;
+  cmd.h = sh;
+  cmd.flip = wren_get_flip(vm, 8);
+  graphics_submit(state, &cmd, nullptr);
+}
+
+void wren_graphics_blit_flip_tint(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 1);
+  int x = (int)wrenGetSlotDouble(vm, 2);
+  int y = (int)wrenGetSlotDouble(vm, 3);
+  int sx = (int)wrenGetSlotDouble(vm, 4);
+  int sy = (int)wrenGetSlotDouble(vm, 5);
+  int sw = (int)wrenGetSlotDouble(vm, 6);
+  int sh = (int)wrenGetSlotDouble(vm, 7);
+
+  unsigned char r = (unsigned char)wrenGetSlotDouble(vm, 11);
+  unsigned char g = (unsigned char)wrenGetSlotDouble(vm, 12);
+  unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 13);
+  unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 14);
+
+  Command cmd = graphics_command(state, CMD_BLIT_FLIP_TINT);
+  cmd.src = *bmp;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.sx = sx;
+  cmd.sy = sy;
+  cmd.w = sw;
+  cmd.h = sh;
+  cmd.flip = wren_get_flip(vm, 8);
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
+}
+
+void wren_graphics_nine_slice(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 1);
+
+  Command cmd = graphics_command(state, CMD_NINE_SLICE);
+  cmd.src = *bmp;
+  cmd.sx = (int)wrenGetSlotDouble(vm, 2);
+  cmd.sy = (int)wrenGetSlotDouble(vm, 3);
+  cmd.sw = (int)wrenGetSlotDouble(vm, 4);
+  cmd.sh = (int)wrenGetSlotDouble(vm, 5);
+  cmd.left = (int)wrenGetSlotDouble(vm, 6);
+  cmd.top = (int)wrenGetSlotDouble(vm, 7);
+  cmd.right = (int)wrenGetSlotDouble(vm, 8);
+  cmd.bottom = (int)wrenGetSlotDouble(vm, 9);
+  cmd.x = (int)wrenGetSlotDouble(vm, 10);
+  cmd.y = (int)wrenGetSlotDouble(vm, 11);
+  cmd.w = (int)wrenGetSlotDouble(vm, 12);
+  cmd.h = (int)wrenGetSlotDouble(vm, 13);
+  cmd.color = new_color(0xff, 0xff, 0xff, 0xff);
+  if (wrenGetSlotCount(vm) > 14) {
+    float alpha = (float)wrenGetSlotDouble(vm, 14);
+    alpha = (alpha < 0) ? 0 : (alpha > 1 ? 1 : alpha);
+    cmd.color.a = (unsigned char)(alpha * 255);
+  }
+  if (wrenGetSlotCount(vm) > 15) {
+    cmd.stretch = wrenGetSlotBool(vm, 15);
+  }
+  graphics_submit(state, &cmd, nullptr);
+}
+
+void wren_graphics_sprite(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  Sprite** spr = (Sprite**)wrenGetSlotForeign(vm, 1);
+  int x = (int)wrenGetSlotDouble(vm, 2);
+  int y = (int)wrenGetSlotDouble(vm, 3);
+  float alpha = (float)wrenGetSlotDouble(vm, 4);
+
+  alpha = (alpha < 0) ? 0 : (alpha > 1 ? 1 : alpha);
+  Command cmd = graphics_command(state, CMD_SPRITE);
+  cmd.spr = *spr;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.w = (*spr)->w;
+  cmd.h = (*spr)->h;
+  cmd.color = new_color(0xff, 0xff, 0xff, (unsigned char)(alpha * 255));
+  graphics_submit(state, &cmd, nullptr);
+}
+
+void wren_graphics_sprite_tint(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  Sprite** spr = (Sprite**)wrenGetSlotForeign(vm, 1);
+  int x = (int)wrenGetSlotDouble(vm, 2);
+  int y = (int)wrenGetSlotDouble(vm, 3);
+
+  unsigned char r = (unsigned char)wrenGetSlotDouble(vm, 4);
+  unsigned char g = (unsigned char)wrenGetSlotDouble(vm, 5);
+  unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 6);
+  unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 7);
+
+  Command cmd = graphics_command(state, CMD_SPRITE);
+  cmd.spr = *spr;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.w = (*spr)->w;
+  cmd.h = (*spr)->h;
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, nullptr);
+}
+
+void wren_graphics_blit_indexed(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  IndexedBitmap** bmp = (IndexedBitmap**)wrenGetSlotForeign(vm, 1);
+  int x = (int)wrenGetSlotDouble(vm, 2);
+  int y = (int)wrenGetSlotDouble(vm, 3);
+  int sx = (int)wrenGetSlotDouble(vm, 4);
+  int sy = (int)wrenGetSlotDouble(vm, 5);
+  int sw = (int)wrenGetSlotDouble(vm, 6);
+  int sh = (int)wrenGetSlotDouble(vm, 7);
+
+  Command cmd = graphics_command(state, CMD_BLIT_INDEXED);
+  cmd.ibmp = *bmp;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.sx = sx;
+  cmd.sy = sy;
+  cmd.w = sw;
+  cmd.h = sh;
+  graphics_submit(state, &cmd, nullptr);
 }
 
 void wren_graphics_print(WrenVM* vm) {
@@ -849,7 +4525,14 @@ void wren_graphics_print(WrenVM* vm) {
   unsigned char b = (unsigned char)wrenGetSlotDouble(vm, 6);
   unsigned char a = (unsigned char)wrenGetSlotDouble(vm, 7);
 
-  font_print(state->bmp, state->font, x, y, new_color(r, g, b, a), text);
+  Command cmd = graphics_command(state, CMD_TEXT);
+  cmd.font = state->font;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.w = font_print_width(state->font, text);
+  cmd.h = font_text_height(state->font, text);
+  cmd.color = new_color(r, g, b, a);
+  graphics_submit(state, &cmd, text);
 }
 
 void wren_graphics_text_width(WrenVM* vm) {
@@ -870,14 +4553,165 @@ void wren_graphics_text_height(WrenVM* vm) {
   wrenSetSlotDouble(vm, 0, height);
 }
 
+void wren_graphics_target(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  Bitmap** bmp = (Bitmap**)wrenGetSlotForeign(vm, 1);
+
+  if (state->num_targets == MAX_TARGETS) {
+    wrenSetSlotString(vm, 0, "render target stack overflow");
+    wrenAbortFiber(vm, 0);
+    return;
+  }
+
+  (*bmp)->refs++;
+  state->targets[state->num_targets++] = state->target;
+  state->target = *bmp;
+}
+
+void wren_graphics_reset_target(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  if (state->num_targets > 0) {
+    bmp_destroy(state->target);
+    state->target = state->targets[--state->num_targets];
+  }
+}
+
+void wren_graphics_deferred(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  wrenSetSlotBool(vm, 0, state->deferred);
+}
+
+void wren_graphics_set_deferred(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  state->deferred = wrenGetSlotBool(vm, 1);
+  if (!state->deferred) {
+    graphics_flush(state);
+  }
+}
+
+// Deferred replays record the last commands again, after the ones already recorded.
+void wren_graphics_replay(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  if (!state->deferred) {
+    cmdbuf_run(&state->last_commands);
+    return;
+  }
+
+  CommandBuffer last = state->last_commands;
+  state->last_commands = (CommandBuffer){0};
+  for (int i = 0; i < last.num_cmds; i++) {
+    Command cmd = last.cmds[i];
+    graphics_submit(state, &cmd, cmd.type == CMD_TEXT ? last.text + cmd.text : nullptr);
+  }
+
+  if (state->last_commands.cmds) {
+    cmdbuf_free(&last);
+  } else {
+    state->last_commands = last;
+  }
+}
+
+void wren_graphics_threads(WrenVM* vm) {
+  wrenSetSlotDouble(vm, 0, raster.num_threads);
+}
+
+void wren_graphics_set_threads(WrenVM* vm) {
+  raster_threads((int)wrenGetSlotDouble(vm, 1));
+}
+
+void wren_graphics_screen_format(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  wrenSetSlotString(vm, 0, state->bmp->blocks ? "bgra-tiled" : "bgra");
+}
+
+// Converts the screen in place once the recorded commands have drawn.
+void wren_graphics_set_screen_format(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  const char* format = wrenGetSlotString(vm, 1);
+
+  graphics_flush(state);
+  if (strcmp(format, "bgra") == 0) {
+    bmp_use_blocks(state->bmp, false);
+  } else if (strcmp(format, "bgra-tiled") == 0) {
+    if (!bmp_use_blocks(state->bmp, true)) {
+      wrenSetSlotString(vm, 0, "failed to allocate bgra-tiled screen");
+      wrenAbortFiber(vm, 0);
+    }
+  }
+}
+
+void wren_graphics_front_to_back(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  wrenSetSlotBool(vm, 0, state->target->root->coverage != nullptr);
+}
+
+// Each enable starts a new pass: draw the nearest layers first and clear last.
+void wren_graphics_set_front_to_back(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  bool enabled = wrenGetSlotBool(vm, 1);
+
+  graphics_flush(state);
+  if (!bmp_cover(state->target, enabled)) {
+    wrenSetSlotString(vm, 0, "failed to allocate coverage mask");
+    wrenAbortFiber(vm, 0);
+  }
+}
+
+void wren_graphics_invalidate(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  damage_add(state->bmp->damage, 0, 0, state->bmp->w, state->bmp->h);
+}
+
+void wren_graphics_invalidate_rect(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+
+  int x = (int)wrenGetSlotDouble(vm, 1);
+  int y = (int)wrenGetSlotDouble(vm, 2);
+  int w = (int)wrenGetSlotDouble(vm, 3);
+  int h = (int)wrenGetSlotDouble(vm, 4);
+
+  int x0 = x > 0 ? x : 0;
+  int y0 = y > 0 ? y : 0;
+  int x1 = x + w < state->bmp->w ? x + w : state->bmp->w;
+  int y1 = y + h < state->bmp->h ? y + h : state->bmp->h;
+  damage_add(state->bmp->damage, x0, y0, x1, y1);
+}
+
+void wren_graphics_dirty_rects(WrenVM* vm) {
+  State* state = (State*)wrenGetUserData(vm);
+  graphics_flush(state);
+
+  Damage* damage = state->bmp->damage;
+  wrenEnsureSlots(vm, 3);
+  wrenSetSlotNewList(vm, 0);
+  for (int i = 0; i < damage->num_rects; i++) {
+    DamageRect* r = &damage->rects[i];
+    wrenSetSlotNewList(vm, 1);
+    wrenSetSlotDouble(vm, 2, r->x0);
+    wrenInsertInList(vm, 1, -1, 2);
+    wrenSetSlotDouble(vm, 2, r->y0);
+    wrenInsertInList(vm, 1, -1, 2);
+    wrenSetSlotDouble(vm, 2, r->x1 - r->x0);
+    wrenInsertInList(vm, 1, -1, 2);
+    wrenSetSlotDouble(vm, 2, r->y1 - r->y0);
+    wrenInsertInList(vm, 1, -1, 2);
+    wrenInsertInList(vm, 0, -1, 1);
+  }
+}
+
 void wren_graphics_width(WrenVM* vm) {
   State* state = (State*)wrenGetUserData(vm);
-  wrenSetSlotDouble(vm, 0, state->bmp->w);
+  wrenSetSlotDouble(vm, 0, state->target->w);
 }
 
 void wren_graphics_height(WrenVM* vm) {
   State* state = (State*)wrenGetUserData(vm);
-  wrenSetSlotDouble(vm, 0, state->bmp->h);
+  wrenSetSlotDouble(vm, 0, state->target->h);
 }
 
 WrenForeignMethodFn wren_bind_method(WrenVM* vm,
@@ -894,16 +4728,80 @@ WrenForeignMethodFn wren_bind_method(WrenVM* vm,
       return wren_bitmap_new;
     } else if (strcmp(signature, "init load(_)") == 0) {
       return wren_bitmap_load;
+    } else if (strcmp(signature, "init load(_,_)") == 0) {
+      return wren_bitmap_load;
+    } else if (strcmp(signature, "init region(_,_,_,_,_)") == 0) {
+      return wren_bitmap_region;
     } else if (strcmp(signature, "width") == 0) {
       return wren_bitmap_width;
     } else if (strcmp(signature, "height") == 0) {
       return wren_bitmap_height;
+    } else if (strcmp(signature, "stride") == 0) {
+      return wren_bitmap_stride;
+    } else if (strcmp(signature, "premultiplied") == 0) {
+      return wren_bitmap_premultiplied;
+    } else if (strcmp(signature, "getPixels(_,_,_,_)") == 0) {
+      return wren_bitmap_get_pixels;
+    } else if (strcmp(signature, "setPixels(_,_,_,_,_)") == 0) {
+      return wren_bitmap_set_pixels;
+    }
+  } else if (strcmp(class_name, "IndexedBitmap") == 0) {
+    if (strcmp(signature, "init load(_)") == 0) {
+      return wren_indexed_bitmap_load;
+    } else if (strcmp(signature, "width") == 0) {
+      return wren_indexed_bitmap_width;
+    } else if (strcmp(signature, "height") == 0) {
+      return wren_indexed_bitmap_height;
+    } else if (strcmp(signature, "transparent") == 0) {
+      return wren_indexed_bitmap_transparent;
+    } else if (strcmp(signature, "transparent=(_)") == 0) {
+      return wren_indexed_bitmap_set_transparent;
+    } else if (strcmp(signature, "color(_)") == 0) {
+      return wren_indexed_bitmap_color;
+    } else if (strcmp(signature, "setColor(_,_,_,_,_)") == 0) {
+      return wren_indexed_bitmap_set_color;
+    }
+  } else if (strcmp(class_name, "Sprite") == 0) {
+    if (strcmp(signature, "init new(_,_,_,_,_)") == 0) {
+      return wren_sprite_new;
+    } else if (strcmp(signature, "width") == 0) {
+      return wren_sprite_width;
+    } else if (strcmp(signature, "height") == 0) {
+      return wren_sprite_height;
     }
   } else if (strcmp(class_name, "Graphics") == 0) {
     if (strcmp(signature, "clip(_,_,_,_)") == 0) {
       return wren_graphics_clip;
     } else if (strcmp(signature, "blitMode(_)") == 0) {
       return wren_graphics_blit_mode;
+    } else if (strcmp(signature, "target(_)") == 0) {
+      return wren_graphics_target;
+    } else if (strcmp(signature, "resetTarget()") == 0) {
+      return wren_graphics_reset_target;
+    } else if (strcmp(signature, "deferred") == 0) {
+      return wren_graphics_deferred;
+    } else if (strcmp(signature, "deferred=(_)") == 0) {
+      return wren_graphics_set_deferred;
+    } else if (strcmp(signature, "replay()") == 0) {
+      return wren_graphics_replay;
+    } else if (strcmp(signature, "threads") == 0) {
+      return wren_graphics_threads;
+    } else if (strcmp(signature, "threads=(_)") == 0) {
+      return wren_graphics_set_threads;
+    } else if (strcmp(signature, "screenFormat") == 0) {
+      return wren_graphics_screen_format;
+    } else if (strcmp(signature, "screenFormat=(_)") == 0) {
+      return wren_graphics_set_screen_format;
+    } else if (strcmp(signature, "frontToBack") == 0) {
+      return wren_graphics_front_to_back;
+    } else if (strcmp(signature, "frontToBack=(_)") == 0) {
+      return wren_graphics_set_front_to_back;
+    } else if (strcmp(signature, "invalidate()") == 0) {
+      return wren_graphics_invalidate;
+    } else if (strcmp(signature, "invalidate(_,_,_,_)") == 0) {
+      return wren_graphics_invalidate_rect;
+    } else if (strcmp(signature, "dirtyRects") == 0) {
+      return wren_graphics_dirty_rects;
     } else if (strcmp(signature, "clear(_,_,_,_)") == 0) {
       return wren_graphics_clear;
     } else if (strcmp(signature, "plot(_,_,_,_,_,_)") == 0) {
@@ -914,12 +4812,42 @@ WrenForeignMethodFn wren_bind_method(WrenVM* vm,
       return wren_graphics_rect;
     } else if (strcmp(signature, "rectLine(_,_,_,_,_,_,_,_)") == 0) {
       return wren_graphics_rect_line;
+    } else if (strcmp(signature, "ellipse(_,_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_ellipse;
+    } else if (strcmp(signature, "ellipseLine(_,_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_ellipse_line;
+    } else if (strcmp(signature, "polygon(_,_,_,_,_)") == 0) {
+      return wren_graphics_polygon;
+    } else if (strcmp(signature, "polygon(_,_,_,_,_,_)") == 0) {
+      return wren_graphics_polygon_rule;
+    } else if (strcmp(signature, "polygonLine(_,_,_,_,_)") == 0) {
+      return wren_graphics_polygon_line;
+    } else if (strcmp(signature, "fill(_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_fill;
     } else if (strcmp(signature, "blit(_,_,_,_,_,_,_)") == 0) {
       return wren_graphics_blit;
     } else if (strcmp(signature, "blitAlpha(_,_,_,_,_,_,_,_)") == 0) {
       return wren_graphics_blit_alpha;
     } else if (strcmp(signature, "blitTint(_,_,_,_,_,_,_,_,_,_,_)") == 0) {
       return wren_graphics_blit_tint;
+    } else if (strcmp(signature, "blitEx(_,_,_,_,_,_,_,_,_,_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_blit_ex;
+    } else if (strcmp(signature, "nineSlice(_,_,_,_,_,_,_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_nine_slice;
+    } else if (strcmp(signature, "nineSlice(_,_,_,_,_,_,_,_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_nine_slice;
+    } else if (strcmp(signature, "nineSlice(_,_,_,_,_,_,_,_,_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_nine_slice;
+    } else if (strcmp(signature, "blitFlip(_,_,_,_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_blit_flip;
+    } else if (strcmp(signature, "blitFlip(_,_,_,_,_,_,_,_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_blit_flip_tint;
+    } else if (strcmp(signature, "blitIndexed(_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_blit_indexed;
+    } else if (strcmp(signature, "sprite(_,_,_,_)") == 0) {
+      return wren_graphics_sprite;
+    } else if (strcmp(signature, "spriteTint(_,_,_,_,_,_,_)") == 0) {
+      return wren_graphics_sprite_tint;
     } else if (strcmp(signature, "print(_,_,_,_,_,_,_)") == 0) {
       return wren_graphics_print;
     } else if (strcmp(signature, "textWidth(_)") == 0) {
@@ -945,6 +4873,12 @@ WrenForeignClassMethods wren_bind_class(WrenVM* vm, const char* module, const ch
   if (strcmp(class_name, "Bitmap") == 0) {
     methods.allocate = wren_bitmap_allocate;
     methods.finalize = wren_bitmap_finalize;
+  } else if (strcmp(class_name, "IndexedBitmap") == 0) {
+    methods.allocate = wren_indexed_bitmap_allocate;
+    methods.finalize = wren_indexed_bitmap_finalize;
+  } else if (strcmp(class_name, "Sprite") == 0) {
+    methods.allocate = wren_sprite_allocate;
+    methods.finalize = wren_sprite_finalize;
   }
 
   return methods;
@@ -959,8 +4893,8 @@ LRESULT CALLBACK wndproc(HWND hwnd, UINT message, WPARAM wparam, LPARAM lparam)
 
   switch (message) {
     case WM_PAINT:
-      StretchDIBits(state->hdc, state->dx, state->dy, state->dw, state->dh, 0, 0, state->bmp->w, state->bmp->h,
-                    state->bmp->data, state->bmi, DIB_RGB_COLORS, SRCCOPY);
+      damage_add(state->bmp->damage, 0, 0, state->bmp->w, state->bmp->h);
+      graphics_present(state);
       ValidateRect(state->hwnd, nullptr);
       break;
 
@@ -997,6 +4931,7 @@ LRESULT CALLBACK wndproc(HWND hwnd, UINT message, WPARAM wparam, LPARAM lparam)
       state->dw = iw;
       state->dh = ih;
 
+      damage_add(state->bmp->damage, 0, 0, state->bmp->w, state->bmp->h);
       break;
 
     case WM_DESTROY:
@@ -1288,10 +5223,25 @@ int WINAPI WinMain(HINSTANCE h_instance, HINSTANCE h_prev_instance, LPSTR p_cmd_
   // INIT WINDOW
   SetProcessDPIAware();
 
+  blit_init();
+
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  raster_threads((int)info.dwNumberOfProcessors);
+
   state.bmp = bmp_create(RES_W, RES_H);
+  if (!state.bmp || !bmp_track(state.bmp)) {
+    printf("failed to create screen\n");
+    if (state.bmp) {
+      bmp_destroy(state.bmp);
+    }
+    wrenFreeVM(state.vm);
+    return 1;
+  }
+  state.target = state.bmp;
   bmp_clear(state.bmp, (Color){30, 30, 30, 255});
 
-  state.font_bmp = bmp_load((void*)e_font, sizeof(e_font));
+  state.font_bmp = bmp_load((void*)e_font, sizeof(e_font), false);
   state.font = font_load(state.font_bmp);
 
   int win_style = WS_OVERLAPPEDWINDOW & ~WS_MAXIMIZEBOX & ~WS_THICKFRAME;
@@ -1349,7 +5299,7 @@ int WINAPI WinMain(HINSTANCE h_instance, HINSTANCE h_prev_instance, LPSTR p_cmd_
   state.bmi->bmiHeader.biPlanes = 1;
   state.bmi->bmiHeader.biBitCount = 32;
   state.bmi->bmiHeader.biCompression = BI_BITFIELDS;
-  state.bmi->bmiHeader.biWidth = state.bmp->w;
+  state.bmi->bmiHeader.biWidth = state.bmp->stride;
   state.bmi->bmiHeader.biHeight = -(LONG)state.bmp->h;
   state.bmi->bmiColors[0].rgbRed = 0xff;
   state.bmi->bmiColors[1].rgbGreen = 0xff;
@@ -1387,19 +5337,20 @@ int WINAPI WinMain(HINSTANCE h_instance, HINSTANCE h_prev_instance, LPSTR p_cmd_
   // MAIN LOOP
   while (true) {
     // CALL UPDATE
+    reset_targets(&state);
     wrenSetSlotHandle(state.vm, 0, state.twig_handle);
     res = wrenCall(state.vm, update_handle);
     if (res != WREN_RESULT_SUCCESS) {
       printf("failed to call update()\n");
       goto cleanup;
     }
+    graphics_flush(&state);
 
     if (state.close) {
       break;
     }
 
-    InvalidateRect(state.hwnd, nullptr, TRUE);
-    SendMessage(state.hwnd, WM_PAINT, 0, 0);
+    graphics_present(&state);
 
     MSG msg;
     while (!state.close && PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
@@ -1440,6 +5391,9 @@ cleanup:
   wrenReleaseHandle(state.vm, state.mouse_move_handler);
   wrenReleaseHandle(state.vm, state.mouse_button_handler);
   wrenReleaseHandle(state.vm, state.key_handler);
+  reset_targets(&state);
+  cmdbuf_free(&state.commands);
+  cmdbuf_free(&state.last_commands);
   wrenFreeVM(state.vm);
 
   bmp_destroy(state.bmp);
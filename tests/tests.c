@@ -0,0 +1,345 @@
+// Checks for the drawing code that the engine itself never runs. Every failed
+// check prints what differed, and the process exits nonzero if any did.
+#include "../src/twig.c"
+
+#define TEST_ROW 72
+
+unsigned test_seed = 1;
+
+unsigned test_rand(void) {
+  test_seed = test_seed * 1103515245 + 12345;
+  return test_seed >> 8;
+}
+
+int test_int(int n) {
+  return (int)(test_rand() % n);
+}
+
+Color test_color(bool opaque) {
+  unsigned v = test_rand();
+  return (Color){v, v >> 8, test_rand(), opaque ? 0xff : test_rand() >> 4};
+}
+
+// Runs every kernel of [kernels] against the reference over rows of every
+// length up to TEST_ROW, with source and destination at every offset within a
+// 32-byte line. Premultiplied tables are checked against the C table with
+// sources whose color does not exceed their alpha.
+bool test_kernel_table(const char* name, BlitRowFn (*kernels)[3][NUM_BLIT_MODES], bool premultiplied) {
+  Color src[TEST_ROW + 8], ref[TEST_ROW + 8], out[TEST_ROW + 8];
+
+  for (int opaque = 0; opaque < 2; opaque++) {
+    for (int kind = 0; kind < 3; kind++) {
+      for (int mode = 0; mode < NUM_BLIT_MODES; mode++) {
+        for (int w = 0; w <= TEST_ROW; w++) {
+          for (int align = 0; align < 64; align++) {
+            Color* ts = &src[align % 8];
+            Color* td = &out[align / 8];
+            Color* tr = &ref[align / 8];
+            for (int i = 0; i < w; i++) {
+              ts[i] = test_color(opaque);
+              if (premultiplied) {
+                ts[i].r = ts[i].r * EXPAND(ts[i].a) >> 8;
+                ts[i].g = ts[i].g * EXPAND(ts[i].a) >> 8;
+                ts[i].b = ts[i].b * EXPAND(ts[i].a) >> 8;
+              }
+              td[i] = tr[i] = test_color(false);
+            }
+            Color tint = test_color(false);
+            if (kind != TINT_FULL) {
+              tint = (Color){0xff, 0xff, 0xff, kind == TINT_NONE ? 0xff : tint.a};
+            }
+
+            if (premultiplied) {
+              blit_kernels_pm_c[opaque][kind][mode](tr, ts, w, tint);
+            } else {
+              blit_row_scalar(tr, ts, w, tint, mode);
+            }
+            kernels[opaque][kind][mode](td, ts, w, tint);
+            for (int i = 0; i < w; i++) {
+              if (memcmp(&tr[i], &td[i], sizeof(Color)) != 0) {
+                printf("%s: opaque %d tint %d mode %d width %d offsets %d/%d differ at %d\n", name, opaque, kind,
+                       mode, w, align % 8, align / 8, i);
+                return false;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool test_kernels(void) {
+  bool ok = test_kernel_table("c", blit_kernels_c, false);
+  ok &= test_kernel_table("sse2", blit_kernels_sse2, false);
+  ok &= test_kernel_table("pm sse2", blit_kernels_pm_sse2, true);
+  if (__builtin_cpu_supports("avx2")) {
+    ok &= test_kernel_table("avx2", blit_kernels_avx2, false);
+    ok &= test_kernel_table("pm avx2", blit_kernels_pm_avx2, true);
+  } else {
+    printf("avx2 kernels skipped, the cpu lacks avx2\n");
+  }
+  return ok;
+}
+
+// What random commands draw: a straight and a premultiplied sheet, a gradient
+// whose alpha varies pixel by pixel, a sprite, an indexed bitmap and text.
+typedef struct {
+  Bitmap* sources[3];
+  Sprite* spr;
+  IndexedBitmap* ibmp;
+  Font* font;
+  const char* text;
+  float points[12];
+} TestScene;
+
+void test_scene_load(TestScene* scene) {
+  size_t size;
+  char* png = read_data("roguelike.png", &size);
+  scene->sources[0] = bmp_load(png, (int)size, false);
+  scene->sources[1] = bmp_load(png, (int)size, true);
+  free(png);
+
+  Bitmap* grad = bmp_create(100, 80);
+  for (int y = 0; y < 80; y++) {
+    for (int x = 0; x < 100; x++) {
+      grad->data[y * grad->stride + x] = new_color(x * 2, y * 3, x + y, (x * 7 + y) & 0xff);
+    }
+  }
+  grad->dirty = true;
+  scene->sources[2] = grad;
+
+  scene->spr = sprite_compile(scene->sources[0], 0, 0, 200, 100);
+  scene->ibmp = indexed_create(160, 120);
+  for (int i = 0; i < 256; i++) {
+    scene->ibmp->palette[i] = new_color(i, 0xff - i, i * 7, i % 5 ? 0xff : i);
+  }
+  for (int i = 0; i < 160 * 120; i++) {
+    scene->ibmp->data[i] = (unsigned char)(i * 31 % 97);
+  }
+  scene->ibmp->transparent = 3;
+  indexed_update(scene->ibmp);
+  scene->font = font_load(bmp_load((void*)e_font, sizeof(e_font), false));
+  scene->text = "Hello, twig!";
+}
+
+void test_scene_free(TestScene* scene) {
+  for (int i = 0; i < 3; i++) {
+    bmp_destroy(scene->sources[i]);
+  }
+  sprite_destroy(scene->spr);
+  indexed_destroy(scene->ibmp);
+  font_destroy(scene->font);
+}
+
+// A random command of any kind for a [w] x [h] target, with its own clip,
+// blit mode, color and source.
+Command test_command(TestScene* scene, int w, int h) {
+  Command cmd = {0};
+  cmd.type = test_int(CMD_TEXT + 1);
+  int a = test_int(4);
+  cmd.color = test_color(a == 0);
+  cmd.color.a = a == 1 ? 0 : cmd.color.a;
+  cmd.blit_mode = test_int(NUM_BLIT_MODES);
+  cmd.cx = test_int(2) ? 0 : test_int(w / 2);
+  cmd.cy = test_int(2) ? 0 : test_int(h / 2);
+  cmd.cw = test_int(3) ? -1 : test_int(w - cmd.cx);
+  cmd.ch = test_int(3) ? -1 : test_int(h - cmd.cy);
+  cmd.cx = cmd.cw < 0 ? 0 : cmd.cx;
+  cmd.cy = cmd.ch < 0 ? 0 : cmd.cy;
+  cmd.x = test_int(w + 60) - 30;
+  cmd.y = test_int(h + 60) - 30;
+  cmd.w = test_int(200);
+  cmd.h = test_int(150);
+  cmd.sx = test_int(300);
+  cmd.sy = test_int(200);
+  cmd.src = scene->sources[test_int(3)];
+
+  switch (cmd.type) {
+    case CMD_LINE:
+      cmd.sx = test_int(w + 60) - 30;
+      cmd.sy = test_int(h + 60) - 30;
+      break;
+    case CMD_BLIT_EX:
+      cmd.tf = (Transform){cmd.x, cmd.y, test_int(628) / 100.0f, 0.5f + test_int(20) / 10.0f,
+                           0.5f + test_int(20) / 10.0f, test_int(50), test_int(50)};
+      break;
+    case CMD_BLIT_FLIP:
+    case CMD_BLIT_FLIP_TINT:
+      cmd.flip = test_int(8);
+      break;
+    case CMD_NINE_SLICE:
+      cmd.sw = cmd.sh = 60;
+      cmd.left = cmd.top = cmd.right = cmd.bottom = 10;
+      cmd.sx = test_int(100);
+      cmd.sy = test_int(100);
+      cmd.stretch = test_int(2);
+      break;
+    case CMD_ELLIPSE:
+    case CMD_ELLIPSE_LINE:
+      cmd.w = test_int(80);
+      cmd.h = test_int(80);
+      break;
+    case CMD_POLYGON:
+    case CMD_POLYGON_LINE:
+      for (int i = 0; i < 12; i++) {
+        scene->points[i] = test_int(i % 2 ? h + 40 : w + 40) - 20 + test_int(100) / 100.0f;
+      }
+      cmd.points = scene->points;
+      cmd.num_points = 6;
+      cmd.rule = test_int(2);
+      break;
+    case CMD_FLOOD_FILL:
+      cmd.x = test_int(w);
+      cmd.y = test_int(h);
+      cmd.tolerance = test_int(3) * 20;
+      break;
+    case CMD_SPRITE:
+      cmd.spr = scene->spr;
+      cmd.w = scene->spr->w;
+      cmd.h = scene->spr->h;
+      break;
+    case CMD_BLIT_INDEXED:
+      cmd.ibmp = scene->ibmp;
+      cmd.sx %= 160;
+      cmd.sy %= 120;
+      break;
+    case CMD_TEXT:
+      cmd.font = scene->font;
+      cmd.w = font_print_width(scene->font, scene->text);
+      cmd.h = font_text_height(scene->font, scene->text);
+      break;
+  }
+  return cmd;
+}
+
+bool test_same(Bitmap* a, Bitmap* b) {
+  for (int y = 0; y < a->h; y++) {
+    if (memcmp(&a->data[y * a->stride], &b->data[y * b->stride], a->w * sizeof(Color)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Draws the same random commands into a tiled bitmap and a row-major one,
+// turning the coverage mask on and off along the way, and compares them after
+// every command.
+bool test_layouts(void) {
+  TestScene scene;
+  test_scene_load(&scene);
+
+  int w = 301, h = 203;
+  Bitmap* tiled = bmp_create(w, h);
+  Bitmap* rows = bmp_create(w, h);
+  bmp_use_blocks(tiled, true);
+
+  bool ok = true;
+  for (int i = 0; i < 20000 && ok; i++) {
+    if (i % 500 == 499) {
+      bool cover = test_int(2);
+      bmp_cover(tiled, cover);
+      bmp_cover(rows, cover);
+    }
+    Command cmd = test_command(&scene, w, h);
+    cmd.dst = tiled;
+    cmd_execute(&cmd, scene.text);
+    cmd.dst = rows;
+    cmd_execute(&cmd, scene.text);
+
+    bmp_deswizzle(tiled, 0, 0, w, h);
+    if (!test_same(tiled, rows)) {
+      printf("layouts: command %d of type %d in mode %d differs\n", i, cmd.type, cmd.blit_mode);
+      ok = false;
+    }
+  }
+
+  bmp_cover(tiled, false);
+  bmp_use_blocks(tiled, false);
+  if (ok && !test_same(tiled, rows)) {
+    printf("layouts: switching back to rows lost pixels\n");
+    ok = false;
+  }
+
+  bmp_destroy(tiled);
+  bmp_destroy(rows);
+  test_scene_free(&scene);
+  return ok;
+}
+
+// Draws runs of opaque commands front to back under a coverage mask and back to
+// front without one, into views offset within their roots, and compares the
+// two. Anything an opaque pixel hides must come out the same either way.
+bool test_coverage(void) {
+  TestScene scene;
+  test_scene_load(&scene);
+  for (int i = 0; i < 256; i++) {
+    scene.ibmp->palette[i].a = 0xff;
+  }
+  indexed_update(scene.ibmp);
+
+  bool ok = true;
+  for (int trial = 0; trial < 400 && ok; trial++) {
+    int w = 100 + test_int(300), h = 50 + test_int(200);
+    int ox = test_int(40), oy = test_int(30);
+    Bitmap* front = bmp_create(w, h);
+    Bitmap* back = bmp_create(w, h);
+    Bitmap* front_view = bmp_view(front, ox, oy, w - ox, h - oy);
+    Bitmap* back_view = bmp_view(back, ox, oy, w - ox, h - oy);
+
+    Command cmds[16];
+    float points[16][12];
+    int n = 1 + test_int(16);
+    for (int i = 0; i < n; i++) {
+      do {
+        cmds[i] = test_command(&scene, w - ox, h - oy);
+      } while (cmds[i].type == CMD_CLEAR || cmds[i].type == CMD_FLOOD_FILL);
+      cmds[i].blit_mode = BLEND_ALPHA;
+      cmds[i].color.a = 0xff;
+      cmds[i].src = cmds[i].src == scene.sources[2] ? scene.sources[0] : cmds[i].src;
+      memcpy(points[i], scene.points, sizeof(points[i]));
+      cmds[i].points = points[i];
+    }
+    Command clear = {.type = CMD_CLEAR, .color = test_color(true), .cw = -1, .ch = -1, .blit_mode = BLEND_ALPHA};
+
+    clear.dst = back_view;
+    cmd_execute(&clear, nullptr);
+    for (int i = 0; i < n; i++) {
+      cmds[i].dst = back_view;
+      cmd_execute(&cmds[i], scene.text);
+    }
+
+    bmp_cover(front, true);
+    for (int i = n - 1; i >= 0; i--) {
+      cmds[i].dst = front_view;
+      cmd_execute(&cmds[i], scene.text);
+    }
+    clear.dst = front_view;
+    cmd_execute(&clear, nullptr);
+    bmp_cover(front, false);
+
+    if (!test_same(front, back)) {
+      printf("coverage: trial %d of %d commands differs\n", trial, n);
+      ok = false;
+    }
+    bmp_destroy(front_view);
+    bmp_destroy(back_view);
+    bmp_destroy(front);
+    bmp_destroy(back);
+  }
+
+  test_scene_free(&scene);
+  return ok;
+}
+
+int main(void) {
+  blit_init();
+
+  bool ok = test_kernels();
+  ok &= test_layouts();
+  ok &= test_coverage();
+
+  printf(ok ? "all tests passed\n" : "tests failed\n");
+  return ok ? 0 : 1;
+}